@@ -9,6 +9,52 @@
 #include <utility>
 #include <vector>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <string_view>
+#include <coroutine>
+#include <optional>
+#include <deque>
+
+#include <csignal>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IO_URING_AVAILABLE 1
+#endif
+#endif
+
+// Set by the build when the libraries were found.
+#if defined(ZLIB_AVAILABLE)
+#include <zlib.h>
+#endif
+#if defined(ZSTD_AVAILABLE)
+#include <zstd.h>
+#endif
 
 // Simplify Namespaces.
 using namespace std;
@@ -21,10 +67,24 @@ namespace fs = std::filesystem;
 // Enable or Disable Multi-threading outputs for testing purposes.
 #define MULTITHREADED_ENABLED 1
 
+// Line batches travel from reader threads to the sorter in groups of this many lines, with at most
+// MULTITHREADED_QUEUE_BATCHES (a power of two) waiting at once.
+#define MULTITHREADED_BATCH_LINES 8192
+#define MULTITHREADED_QUEUE_BATCHES 64
+
+// Files at least this large are split into byte ranges and parsed by several threads.
+#define CHUNKED_READ_THRESHOLD (64ull * 1024 * 1024)
+
+// Reads are scheduled largest first. Files past CHUNKED_READ_THRESHOLD are cut into READ_SPLIT_BYTES
+// pieces, and small files are grouped until a group holds READ_BATCH_BYTES.
+#define READ_SPLIT_BYTES (16ull * 1024 * 1024)
+#define READ_BATCH_BYTES (4ull * 1024 * 1024)
+
 enum class ESortType { AlphAsc, AlphDesc, LastLetterAsc };
 
 class IStringComparer {
 public:
+    virtual ~IStringComparer() = default;
     virtual bool IsFirstAboveSecond(string firstString, string secondString) = 0;
 };
 
@@ -44,24 +104,693 @@ public:
 
 };
 
+enum class EOutputFormat { Text, Indexed, FrontCoded };
+
+// Default goes through the page cache as usual. DontNeed also goes through it but hints sequential access
+// and drops the pages once used. Direct bypasses it with O_DIRECT and aligned blocks.
+enum class EIoMode { Default, DontNeed, Direct };
+
+// Compressed inputs are recognised by their magic bytes, whatever the file is called.
+enum class ECompression { None, Gzip, Zstd };
+
+// How text outputs reach the disk. Stream writes the lines in order on one thread. Pwrite cuts them into
+// partitions that writerThreads workers write in place at offsets known up front. Mapped does the same with
+// memcpy into a shared mapping of the preallocated file, and lets the final merge run straight into it.
+enum class EWriteMethod { Stream, Pwrite, Mapped };
+
+// Sharded outputs are split into several files with disjoint key ranges. Range cuts shardCount shards of about
+// equal bytes, Letter starts a new shard wherever the leading letter in sort order changes.
+enum class EShardMethod { None, Range, Letter };
+
+// Options shared by every sort job, set from the command line or a manifest line as key=value.
+struct SortOptions {
+    string outputDirectory = "../OutputText/";
+    EOutputFormat format = EOutputFormat::Text;
+    EIoMode ioMode = EIoMode::Default;
+    EWriteMethod writeMethod = EWriteMethod::Stream;
+    unsigned int writerThreads = max(1u, thread::hardware_concurrency());
+    EShardMethod shardMethod = EShardMethod::None;
+    unsigned int shardCount = 1;
+    // Non-empty to sort externally: sorted runs of about spillRunBytes go to compressed files here.
+    string spillDirectory;
+    size_t spillRunBytes = size_t(64) * 1024 * 1024;
+    // Logs every finished run with the inputs it holds, so an interrupted external sort resumes from them.
+    // Merge progress is not logged: a run interrupted while merging keeps its runs but merges them again.
+    bool checkpoint = false;
+    // Non-zero to keep sorted runs in memory until the tracked total nears this, then spill them to
+    // spillDirectory, or a directory under the system temp directory when none is given.
+    size_t memoryLimitBytes = 0;
+    // Text outputs only. A level of -1 picks the codec's default.
+    ECompression compression = ECompression::None;
+    int compressionLevel = -1;
+};
+
+// Manifest-wide "set" lines.
+struct RunnerSettings {
+    unsigned int threadCount = max(1u, thread::hardware_concurrency());
+    size_t memoryLimitBytes = size_t(1024) * 1024 * 1024;
+    string cacheDirectory;
+    string resultDirectory;
+    uintmax_t resultLimitBytes = uintmax_t(4096) * 1024 * 1024;
+    EIoMode inputIoMode = EIoMode::Default;
+};
+
+// One entry of a batch manifest.
+struct SortJob {
+    vector<string> inputPatterns;
+    ESortType sortType = ESortType::AlphAsc;
+    string outputName;
+    SortOptions options;
+};
+
+// An input file with the size it had when it was found.
+struct InputFile {
+    string path;
+    uintmax_t size = 0;
+};
+
+// One piece of reading work: either a byte range of one large file or a group of whole small files.
+struct ReadUnit {
+    vector<string> files;
+    uintmax_t offset = 0;
+    uintmax_t length = 0;
+    uintmax_t bytes = 0;
+    bool isRange = false;
+    bool isCompressed = false;
+};
+
+// Hands ReadUnits to reader threads biggest first. Units may keep arriving while the readers run, e.g. from a
+// directory walk. Next blocks until there is a unit, and returns false once Finish was called and all are taken.
+class ReadScheduler {
+public:
+    void Push(ReadUnit unit);
+    void AddFile(const InputFile& file);
+    void Finish();
+    bool Next(ReadUnit& unitOut);
+
+private:
+    vector<ReadUnit> units;
+    ReadUnit pendingGroup;
+    mutex schedulerMutex;
+    condition_variable schedulerSignal;
+    bool finished = false;
+};
+
+// How a directory walk treats symbolic links. Skip ignores them, Files follows links to files only and
+// Follow also descends into linked directories, visiting each real directory once.
+enum class ESymlinkPolicy { Skip, Files, Follow };
+
+// Filters for a recursive walk. A pattern containing '/' matches the path below the root, any other
+// pattern matches the file name. Excluded directories are not entered.
+struct ScanOptions {
+    vector<string> includePatterns;
+    vector<string> excludePatterns;
+    uintmax_t minSize = 0;
+    uintmax_t maxSize = UINTMAX_MAX;
+    ESymlinkPolicy symlinks = ESymlinkPolicy::Files;
+};
+
+// Fixed set of worker threads pulling tasks from a shared queue.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned int threadCount);
+    ~WorkerPool();
+    future<void> Submit(function<void()> task);
+    unsigned int Size() const { return (unsigned int)workers.size(); }
+
+private:
+    vector<thread> workers;
+    queue<packaged_task<void()>> tasks;
+    mutex queueMutex;
+    condition_variable queueSignal;
+    bool stopping = false;
+};
+
+// Byte budget shared by concurrent jobs. Acquire blocks until enough bytes are free.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(size_t limitBytes) : limit(limitBytes) {}
+    void Acquire(size_t bytes);
+    void Release(size_t bytes);
+
+private:
+    size_t limit;
+    size_t used = 0;
+    mutex budgetMutex;
+    condition_variable budgetSignal;
+};
+
+// Bytes acquired from a MemoryBudget for as long as it is in scope, so a job that throws still gives them back.
+class BudgetReservation {
+public:
+    BudgetReservation(MemoryBudget& memoryBudget, size_t byteCount) : budget(memoryBudget), bytes(byteCount) { budget.Acquire(bytes); }
+    ~BudgetReservation() { budget.Release(bytes); }
+    BudgetReservation(const BudgetReservation&) = delete;
+    BudgetReservation& operator=(const BudgetReservation&) = delete;
+
+private:
+    MemoryBudget& budget;
+    size_t bytes;
+};
+
+// What tracked memory holds: lines kept between stages, merge sort scratch, file contents and write
+// buffers, and line batches waiting in queues.
+enum class EMemoryUse { Lines, SortScratch, IoBuffers, Queues, Count };
+
+// Process-wide count of the bytes the sorting stages hold. Unlike MemoryBudget it never blocks, it only
+// tells spillers with a limit when to move their runs to disk. Manifest jobs do not report here, their
+// memory is bounded by the runner's MemoryBudget instead.
+class MemoryGovernor {
+public:
+    void SetLimit(size_t bytes) { limit = bytes; }
+    size_t Limit() const { return limit; }
+    void Charge(EMemoryUse use, size_t bytes);
+    void Release(EMemoryUse use, size_t bytes);
+    size_t Used() const { return used.load(memory_order_relaxed); }
+    size_t UsedBy(EMemoryUse use) const { return byUse[size_t(use)].load(memory_order_relaxed); }
+    bool ShouldSpill() const { return limit > 0 && Used() >= limit / 4 * 3; }
+
+private:
+    size_t limit = 0;
+    atomic<size_t> used{ 0 };
+    atomic<size_t> byUse[size_t(EMemoryUse::Count)] = {};
+};
+
+static MemoryGovernor memoryGovernor;
+
+// Holds a charge for as long as it is in scope.
+class MemoryCharge {
+public:
+    MemoryCharge(EMemoryUse memoryUse, size_t byteCount) : use(memoryUse), bytes(byteCount) { memoryGovernor.Charge(use, bytes); }
+    ~MemoryCharge() { memoryGovernor.Release(use, bytes); }
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+private:
+    EMemoryUse use;
+    size_t bytes;
+};
+
+// Read-only view of a whole file. Memory-mapped where available, otherwise read into a buffer.
+class MappedFile {
+public:
+    explicit MappedFile(const string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    bool IsOpen() const { return isOpen; }
+    const char* Data() const { return data; }
+    size_t Size() const { return size; }
+    // Modification time taken before the contents, in fs::last_write_time ticks. Zero if unknown.
+    int64_t Modified() const { return modified; }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    int64_t modified = 0;
+    bool isOpen = false;
+    bool isMapped = false;
+    vector<char> buffer;
+};
+
+// Writable shared mapping of a new file of a fixed size. The blocks are reserved before mapping, so stores
+// into it cannot fault on a full disk halfway through.
+class WritableMapping {
+public:
+    WritableMapping() = default;
+    ~WritableMapping();
+    WritableMapping(const WritableMapping&) = delete;
+    WritableMapping& operator=(const WritableMapping&) = delete;
+    bool Create(const string& path, size_t fileSize);
+    char* Data() const { return data; }
+    size_t Size() const { return size; }
+    bool Close(EIoMode ioMode);
+
+private:
+    int fd = -1;
+    char* data = nullptr;
+    size_t size = 0;
+};
+
+// Block-aligned heap memory, as O_DIRECT transfers require.
+class AlignedBuffer {
+public:
+    explicit AlignedBuffer(size_t capacity);
+    ~AlignedBuffer();
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+    char* Data() const { return data; }
+    size_t Capacity() const { return capacity; }
+
+private:
+    char* data = nullptr;
+    size_t capacity = 0;
+};
+
+// Sequential output file honouring an EIoMode. Used for outputs and anything else written once and
+// not read back soon.
+class FileSink {
+public:
+    FileSink(const string& path, EIoMode mode);
+    ~FileSink();
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+    bool IsOpen() const;
+    void Write(const char* data, size_t size);
+    void Write(const string& text) { Write(text.data(), text.size()); }
+    bool Close();
+
+private:
+    bool FlushBuffer(bool isFinal);
+    EIoMode mode;
+    ofstream stream;
+    int fd = -1;
+    unique_ptr<AlignedBuffer> buffer;
+    size_t filled = 0;
+    uint64_t written = 0;
+    uint64_t droppedUpTo = 0;
+    bool failed = false;
+};
+
+// Text output compressed as a series of independent frames. Full chunks are compressed on the sink's own
+// pool, or on one shared by several sinks, while the caller keeps producing lines, and the frames are written
+// out in order.
+class CompressedSink {
+public:
+    CompressedSink(const string& path, ECompression codec, int level, EIoMode ioMode);
+    CompressedSink(const string& path, ECompression codec, int level, EIoMode ioMode, WorkerPool& sharedPool);
+    ~CompressedSink();
+    CompressedSink(const CompressedSink&) = delete;
+    CompressedSink& operator=(const CompressedSink&) = delete;
+    bool IsOpen() const { return sink.IsOpen(); }
+    void Write(const char* data, size_t size);
+    void Write(const string& text) { Write(text.data(), text.size()); }
+    bool Close();
+
+private:
+    void SubmitChunk();
+    void WriteFinished(size_t keepInFlight);
+    FileSink sink;
+    ECompression compression;
+    int compressionLevel;
+    unique_ptr<WorkerPool> ownedPool;
+    WorkerPool& pool;
+    string chunk;
+    deque<pair<future<void>, shared_ptr<string>>> inFlight;
+    bool closed = false;
+};
+
+// Validated lines of one input file. Loaded from the on-disk parse cache the lines point into the mapping,
+// otherwise into the parsed strings kept in owned.
+struct CachedFileLines {
+    shared_ptr<MappedFile> mapping;
+    vector<string> owned;
+    vector<string_view> lines;
+    uint64_t rejectedCount = 0;
+};
+
+// On-disk cache of validated input files, keyed by path, size, mtime and content hash.
+class ParsedFileCache {
+public:
+    explicit ParsedFileCache(string directory) : cacheDirectory(std::move(directory)) {}
+    shared_ptr<const CachedFileLines> Read(const string& fileName);
+    bool Load(const string& fileName, CachedFileLines& out);
+    void Store(const string& fileName, const MappedFile& source, const vector<string>& lines, const vector<string>& rejected);
+
+private:
+    string CachePathFor(const string& fileName) const;
+    string cacheDirectory;
+};
+
+// Finished outputs keyed by a hash of the job's inputs, sort type and output options.
+// Least recently used entries are evicted once the cache grows past its byte limit.
+class ResultCache {
+public:
+    ResultCache(string directory, uintmax_t limitBytes) : cacheDirectory(std::move(directory)), byteLimit(limitBytes) {}
+    string KeyFor(const vector<string>& inputFiles, ESortType sortType, const SortOptions& options) const;
+    bool Fetch(const string& key, const string& outputPath);
+    void Store(const string& key, const string& outputPath);
+
+private:
+    void Evict();
+    string cacheDirectory;
+    uintmax_t byteLimit;
+    mutex cacheMutex;
+};
+
+// Read side of the indexed output format. Lookups binary search the mapping without loading it.
+class IndexedOutputReader {
+public:
+    bool Open(const string& path);
+    ESortType SortType() const { return sortType; }
+    size_t Count() const { return size_t(entryCount); }
+    string_view At(size_t index) const;
+    size_t PartitionPoint(const function<bool(const string&)>& isBefore) const;
+    size_t LowerBound(const string& key) const;
+    bool Contains(const string& key) const;
+    void ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const;
+
+private:
+    shared_ptr<MappedFile> mapping;
+    ESortType sortType = ESortType::AlphAsc;
+    uint64_t entryCount = 0;
+    uint64_t blockSize = 1;
+    uint64_t blockCount = 0;
+    const char* strings = nullptr;
+    const char* offsets = nullptr;
+    const char* blockKeyOffsets = nullptr;
+    const char* blockKeys = nullptr;
+    unique_ptr<IStringComparer> stringComparer;
+};
+
+// Read side of the front-coded output format. Random access decodes forward from the nearest restart point.
+class FrontCodedReader {
+public:
+    bool Open(const string& path);
+    ESortType SortType() const { return sortType; }
+    size_t Count() const { return size_t(entryCount); }
+    string At(size_t index) const;
+    size_t PartitionPoint(const function<bool(const string&)>& isBefore) const;
+    size_t LowerBound(const string& key) const;
+    bool Contains(const string& key) const;
+    void ForEach(const function<void(const string&)>& visit) const;
+    void ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const;
+
+private:
+    shared_ptr<MappedFile> mapping;
+    ESortType sortType = ESortType::AlphAsc;
+    uint64_t entryCount = 0;
+    uint64_t restartInterval = 1;
+    uint64_t restartCount = 0;
+    const char* entries = nullptr;
+    const char* entriesEnd = nullptr;
+    const char* restartOffsets = nullptr;
+    unique_ptr<IStringComparer> stringComparer;
+};
+
+// Plain newline-delimited output searched in place. Positions are byte offsets of line starts.
+class TextOutputReader {
+public:
+    bool Open(const string& path);
+    size_t PartitionPoint(const function<bool(const string&)>& isBefore) const;
+    void ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const;
+    bool LooksSorted(ESortType sortType, size_t probeCount) const;
+
+private:
+    size_t LineEnd(size_t start) const;
+    shared_ptr<MappedFile> mapping;
+};
+
+// Bounded lock-free queue after Dmitry Vyukov's array queue. Any number of producers and consumers may use
+// it; every slot carries a sequence number telling producers and consumers whose turn it is.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacityPowerOfTwo) : cells(capacityPowerOfTwo), mask(capacityPowerOfTwo - 1) {
+        for (size_t i = 0; i < cells.size(); ++i) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool TryPush(T& value) {
+        size_t position = enqueuePosition.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Blocks while the queue is full. This is the backpressure that keeps fast readers from running ahead.
+    void Push(T value) {
+        while (!TryPush(value)) {
+            this_thread::yield();
+        }
+    }
+
+    bool TryPop(T& out) {
+        size_t position = dequeuePosition.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    out = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+    vector<Cell> cells;
+    size_t mask;
+    // Kept on separate cache lines so producers and the consumer do not contend.
+    alignas(64) atomic<size_t> enqueuePosition{ 0 };
+    alignas(64) atomic<size_t> dequeuePosition{ 0 };
+};
+
+// Files parsed once and shared by every job that lists them. Jobs announce each file they will Get with
+// AddUse before any of them runs, and Release it when done. An entry is dropped with its last use, so the
+// cache only holds inputs some job still needs.
+class ParsedInputCache {
+public:
+    explicit ParsedInputCache(ParsedFileCache* diskCache = nullptr, EIoMode readMode = EIoMode::Default)
+        : fileCache(diskCache), ioMode(readMode) {}
+    void AddUse(const string& fileName);
+    void Release(const string& fileName);
+    shared_ptr<const CachedFileLines> Get(const string& fileName);
+
+private:
+    struct Entry {
+        shared_future<shared_ptr<const CachedFileLines>> lines;
+        bool isLoading = false;
+        size_t uses = 0;
+    };
+    ParsedFileCache* fileCache;
+    EIoMode ioMode;
+    unordered_map<string, Entry> entries;
+    mutex cacheMutex;
+};
+
+// Releases a job's uses of its inputs, early when asked, otherwise however the job ends.
+class InputUses {
+public:
+    InputUses(ParsedInputCache& inputCache, const vector<string>& fileNames) : cache(inputCache), files(fileNames) {}
+    ~InputUses() { Release(); }
+    InputUses(const InputUses&) = delete;
+    InputUses& operator=(const InputUses&) = delete;
+    void Release() {
+        if (released) return;
+        released = true;
+        for (const auto & file : files) cache.Release(file);
+    }
+
+private:
+    ParsedInputCache& cache;
+    const vector<string>& files;
+    bool released = false;
+};
+
+// Sequential reader of one spilled run. The block after the current one is decompressed on the pool
+// while the current one is consumed.
+class SpillRunReader {
+public:
+    bool Open(const string& path, WorkerPool& decoderPool);
+    bool HasHead() const { return position < lines.size(); }
+    const string& Head() const { return lines[position]; }
+    void Advance();
+
+private:
+    void DecodeNextBlockLater();
+    void Refill();
+    shared_ptr<MappedFile> mapping;
+    WorkerPool* decoders = nullptr;
+    bool shareSuffix = false;
+    const char* cursor = nullptr;
+    const char* end = nullptr;
+    string path;
+    vector<string> lines;
+    size_t position = 0;
+    future<void> nextDecode;
+    shared_ptr<vector<string>> nextLines;
+    bool hasNext = false;
+};
+
+// Sorted runs kept on disk in compressed blocks while the rest of the input is read. Runs handed to Add
+// are gathered in memory until they hold runBytes, then merged into one and written by the pool. A spiller
+// made with spillOnPressure holds every run in memory until the memory governor says to spill.
+class RunSpiller {
+public:
+    RunSpiller(string directory, string namePrefix, ESortType sortType, size_t runBytes, EIoMode ioMode,
+               bool spillOnPressure = false);
+    ~RunSpiller();
+    RunSpiller(const RunSpiller&) = delete;
+    RunSpiller& operator=(const RunSpiller&) = delete;
+    vector<string> Resume(const vector<string>& inputFiles);
+    void Add(vector<string>&& sortedRun, vector<string> sources = {});
+    void Finish();
+    void Merge(const function<void(const string&)>& emit);
+    void Complete() { completed = true; }
+    bool KeepsRunsInMemory() const { return onPressure && runPaths.empty(); }
+    vector<vector<string>> TakeRuns();
+
+private:
+    struct InputIdentity {
+        string path;
+        uintmax_t size = 0;
+        int64_t modified = 0;
+    };
+    struct PendingRun {
+        vector<string> lines;
+        vector<string> sources;
+        size_t bytes = 0;
+    };
+    void SpillPending();
+    void LogRun(size_t runNumber, size_t lineCount, uint64_t fileHash, const vector<string>& sources);
+    string spillDirectory;
+    string prefix;
+    ESortType sortType;
+    size_t runLimit;
+    EIoMode writeMode;
+    bool onPressure;
+    WorkerPool pool;
+    mutex spillMutex;
+    vector<PendingRun> pending;
+    size_t pendingBytes = 0;
+    vector<string> runPaths;
+    size_t nextRunNumber = 0;
+    vector<future<void>> writes;
+    size_t waitedWrites = 0;
+    // Set by Resume. Runs and the log then stay on disk until Complete is called.
+    bool checkpointing = false;
+    bool completed = false;
+    string logPath;
+    mutex logMutex;
+    map<string, InputIdentity> identities;
+};
+
 
 ////// Function Prototypes
 void singleThreading(const vector<string>& fileList, ESortType sortType, const string& outputName);
-void multiThreading(vector<string> fileList, ESortType sortType, const string& outputName);
+void multiThreading(const vector<InputFile>& inputFiles, ESortType sortType, const string& outputName);
+vector<ReadUnit> PlanReads(const vector<InputFile>& inputFiles);
+vector<vector<string>> SortScheduledRuns(ReadScheduler& scheduler, ESortType sortType, RunSpiller* spiller = nullptr);
+vector<string> MergeRuns(vector<vector<string>> runs, ESortType sortType);
+void MergeWriteAndPrint(vector<vector<string>> runs, const string& outputName, clock_t startTime,
+                        ESortType sortType, const SortOptions& options);
+void MergeSpilledWriteAndPrint(RunSpiller& spiller, const string& outputName, clock_t startTime,
+                               ESortType sortType, const SortOptions& options);
+unique_ptr<RunSpiller> MakeSpiller(const string& outputPath, ESortType sortType, const SortOptions& options);
+string SpillDirectoryFor(const SortOptions& options);
+void LzCompress(const char* data, size_t size, string& out);
+bool LzDecompress(const char* data, size_t size, char* out, size_t outSize);
+bool WriteSpillRun(const vector<string>& lines, const string& path, ESortType sortType, EIoMode ioMode,
+                   uint64_t* fileHash = nullptr);
+void EnumerateInputs(const vector<string>& roots, const ScanOptions& scan, unsigned int threadCount,
+                     const function<void(InputFile&&)>& onFile);
+bool ParseScanTokens(const vector<string>& tokens, SortJob& job, ScanOptions& scan, string& error);
+int RunScan(const SortJob& job, const ScanOptions& scan);
 vector<string> ReadFile(const string& fileName);
+void ParseBuffer(const char* data, size_t size, const string& fileName, vector<string>& listOut, vector<string>* rejectedOut);
+void ParseInput(const char* data, size_t size, const string& fileName, vector<string>& listOut, vector<string>* rejectedOut);
+ECompression DetectCompression(const char* data, size_t size);
+ECompression DetectFileCompression(const string& fileName);
+bool DecodeCompressedInput(const char* data, size_t size, const string& fileName, const function<void(const char*, size_t)>& onText);
+bool ReadCompressedFile(const string& fileName, const function<void(vector<string>&&)>& onLines);
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed = 14695981039346656037ull);
+vector<string> ReadFileChunked(const string& fileName, unsigned int chunkCount);
+void ReadFileChunked(const string& fileName, unsigned int chunkCount, const function<void(size_t, vector<string>&&)>& onChunk);
+void ReadFileRange(const string& fileName, uintmax_t offset, uintmax_t length, vector<string>& listOut);
+vector<string> ReadInputFile(const string& fileName);
+void ReadManyFiles(const vector<string>& fileList, WorkerPool& parsers, WorkerPool& readers,
+                   const function<void(size_t, vector<string>&&)>& onParsed);
+vector<string> ReadManyFiles(const vector<string>& fileList);
 vector<string> MergeSortWrapper(vector<string> listToSort, ESortType sortType);
-void WriteAndPrint(const vector<string>& finalList, const string& outputName, int clockCounter);
+size_t LineBytes(const vector<string>& lines);
+unique_ptr<IStringComparer> MakeComparer(ESortType sortType);
+vector<string> MergeSortedLists(const vector<string>& first, const vector<string>& second, IStringComparer* stringComparer);
+vector<string> MergeSortedLists(vector<string>&& first, vector<string>&& second, IStringComparer* stringComparer);
+vector<string> ReadLines(const string& fileName);
+void WriteLines(const vector<string>& lines, const string& filePath, EIoMode ioMode = EIoMode::Default);
+void WriteLines(const vector<string>& lines, size_t from, size_t to, const string& filePath, EIoMode ioMode);
+bool WriteLinesParallel(const vector<string>& lines, const string& filePath, unsigned int writerCount, EIoMode ioMode);
+bool MergeRunsToMapping(const vector<const vector<string>*>& runs, const string& filePath, ESortType sortType,
+                        unsigned int writerCount, EIoMode ioMode);
+void WriteShardedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, const SortOptions& options);
+void WriteCompressedLines(const vector<string>& lines, size_t from, size_t to, const string& filePath, const SortOptions& options,
+                          WorkerPool* sharedPool = nullptr);
+string CompressFrames(const char* data, size_t size, ECompression compression, int level);
+string ShardPathFor(const string& filePath, size_t shardIndex);
+vector<string> ReadFileWithMode(const string& fileName, EIoMode ioMode);
+bool ParseIoMode(const string& text, EIoMode& ioModeOut);
+bool IncrementalUpdate(const SortJob& job);
+int RunCoroutinePipeline(const SortJob& job);
+void WriteAndPrint(const vector<string>& finalList, const string& outputName, int clockCounter,
+                   ESortType sortType = ESortType::AlphAsc, const SortOptions& options = SortOptions());
+void WriteIndexedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, EIoMode ioMode);
+void WriteFrontCodedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, EIoMode ioMode);
+int RunQuery(const vector<string>& args);
+int RunSetOperation(const vector<string>& args);
+bool IsSortedFile(const string& fileName, IStringComparer* stringComparer);
+void AppendFrontCoded(string& out, const string& previous, const string& current, bool shareSuffix);
+bool ReadFrontCoded(const char*& cursor, const char* end, string& previousInOut, bool shareSuffix);
+bool SortsBefore(IStringComparer* stringComparer, const string& first, const string& second);
+void PrintTime(const string& outputName, int clockCounter);
+int RunCommand(const vector<string>& args);
+int RunManifest(const string& manifestPath);
+bool LoadManifest(const string& manifestPath, vector<SortJob>& jobs, RunnerSettings& settings);
+int RunWatch(const vector<SortJob>& jobs);
+bool ParseSortType(const string& text, ESortType& sortTypeOut);
+bool ParseJobTokens(const vector<string>& tokens, SortJob& job, string& error);
+string UnsupportedSpillOption(const SortOptions& options, bool allowSpill);
+vector<string> ExpandJobInputs(const SortJob& job);
+bool ApplyOption(SortOptions& options, const string& key, const string& value);
+bool MatchesWildcard(const string& text, const string& pattern);
+vector<string> ExpandInputPattern(const string& pattern);
+string OutputPathFor(const string& outputName, const SortOptions& options);
+string DescribeOutputOptions(const SortOptions& options);
+bool LinkOrCopyFile(const string& from, const string& to);
 
 
 ////// Main
-int main() {
+int main(int argc, char* argv[]) {
+
+    // Any arguments select one of the command modes instead of the default demo run.
+    vector<string> args(argv + 1, argv + argc);
+    if (!args.empty()) {
+        return RunCommand(args);
+    }
 
-    // Enumerate the directory for input files.
+    // Enumerate the directory for input files, noting each size while the entry is at hand.
     vector<string> fileList;
+    vector<InputFile> inputFiles;
     string inputDirectoryPath = "../InputText";
     for (const auto & entry : fs::directory_iterator(inputDirectoryPath)) {
         if (!fs::is_directory(entry)) {
+            error_code ec;
+            uintmax_t size = entry.file_size(ec);
             fileList.push_back(entry.path().string());
+            inputFiles.push_back({ entry.path().string(), ec ? 0 : size });
         }
     }
 
@@ -70,9 +799,9 @@ int main() {
     singleThreading(fileList, ESortType::AlphDesc, "AlphabeticalDescendingTextOutput");
     singleThreading(fileList, ESortType::LastLetterAsc, "LastLetterAscendingTextOutput");
 #if MULTITHREADED_ENABLED
-    multiThreading(fileList, ESortType::AlphAsc, "MultiAscTextOutput");
-    multiThreading(fileList, ESortType::AlphDesc, "MultiDescTextOutput");
-    multiThreading(fileList, ESortType::LastLetterAsc, "MultiLastLetterTextOutput");
+    multiThreading(inputFiles, ESortType::AlphAsc, "MultiAscTextOutput");
+    multiThreading(inputFiles, ESortType::AlphDesc, "MultiDescTextOutput");
+    multiThreading(inputFiles, ESortType::LastLetterAsc, "MultiLastLetterTextOutput");
 #endif
 
     // Wait
@@ -104,52 +833,243 @@ void singleThreading(const vector<string>& fileList, ESortType sortType, const s
 
 
 ////// Multi-Threaded Sorting
-void multiThreading(vector<string> fileList, ESortType sortType, const string& outputName) {
+void multiThreading(const vector<InputFile>& inputFiles, ESortType sortType, const string& outputName) {
 
     // Use clocks to measure speed and efficiency.
     clock_t startTime = clock();
     vector<string> finalList;
 
-    // Create vector of shared pointers and futures to track tasks and completion.
-    vector<future<vector<string>>> futures(fileList.size());
-    vector<shared_ptr<atomic<bool>>> done(fileList.size());
+    // The work is cut into units and handed out biggest first, so a huge file found last still starts
+    // early and the threads run out of work at about the same time.
+    ReadScheduler scheduler;
+    for (auto& unit : PlanReads(inputFiles)) {
+        scheduler.Push(std::move(unit));
+    }
+    scheduler.Finish();
+    finalList = MergeRuns(SortScheduledRuns(scheduler, sortType), sortType);
+    clock_t endTime = clock();
 
-    for (size_t i = 0; i < fileList.size(); ++i) {
+    // Write the results.
+    WriteAndPrint(finalList, outputName, endTime - startTime);
+}
 
-        // Initially set to not done. shared_ptr ensures it is alive for lambda operation.
-        done[i] = make_shared<atomic<bool>>(false);
-        // Pass the file and doneFlag to lambda for reading.
-        futures[i] = async(launch::async, [](const string& file, const shared_ptr<atomic<bool>>& doneFlag) {
-            auto result = ReadFile(file);
+// Reader threads take units from the scheduler until it runs dry, while this thread sorts their batches.
+// Returns the sorted runs, one per batch, or nothing if they all went to the spiller.
+vector<vector<string>> SortScheduledRuns(ReadScheduler& scheduler, ESortType sortType, RunSpiller* spiller) {
+    unsigned int readerCount = max(2u, thread::hardware_concurrency());
 
+    // Readers hand their lines over in batches as soon as each file or chunk is parsed, so sorting starts
+    // with the first batch instead of after the last read.
+    // The sorter sleeps on readySignal until a batch has landed or the last reader has left. queuedBatches
+    // counts batches fully pushed and not yet taken.
+    BoundedQueue<vector<string>> batches(MULTITHREADED_QUEUE_BATCHES);
+    atomic<size_t> activeReaders(readerCount);
+    mutex readyMutex;
+    condition_variable readySignal;
+    size_t queuedBatches = 0;
+    auto handOver = [&](size_t, vector<string>&& lines) {
+        for (size_t start = 0; start < lines.size(); start += MULTITHREADED_BATCH_LINES) {
+            size_t end = min(lines.size(), start + MULTITHREADED_BATCH_LINES);
+            vector<string> batch(make_move_iterator(lines.begin() + start), make_move_iterator(lines.begin() + end));
+            memoryGovernor.Charge(EMemoryUse::Queues, LineBytes(batch));
+            batches.Push(std::move(batch));
+            {
+                lock_guard<mutex> lock(readyMutex);
+                ++queuedBatches;
+            }
+            readySignal.notify_one();
+        }
+    };
+    // Counts a reader out however it leaves, so a reader that throws cannot leave the sorter waiting.
+    struct ReaderLeaving {
+        atomic<size_t>& activeReaders;
+        mutex& readyMutex;
+        condition_variable& readySignal;
+        ~ReaderLeaving() {
+            {
+                lock_guard<mutex> lock(readyMutex);
+                activeReaders.fetch_sub(1);
+            }
+            readySignal.notify_one();
+        }
+    };
 
-            // Set the done flag to true once ReadFile is done.
-            *doneFlag = true;
-            return result;
-        }, fileList[i], done[i]);
+    // Groups of small files are parsed, and read where io_uring is missing, on pools shared by all readers.
+    WorkerPool parsers(max(1u, thread::hardware_concurrency()));
+    WorkerPool manyFileReaders(max(4u, thread::hardware_concurrency() * 2));
+    vector<future<void>> futures(readerCount);
+    for (unsigned int i = 0; i < readerCount; ++i) {
+        futures[i] = async(launch::async, [&]() {
+            ReaderLeaving leaving{ activeReaders, readyMutex, readySignal };
+            ReadUnit work;
+            while (scheduler.Next(work)) {
+                if (work.isCompressed) {
+                    ReadCompressedFile(work.files[0], [&handOver](vector<string>&& lines) { handOver(0, std::move(lines)); });
+                } else if (work.isRange) {
+                    vector<string> lines;
+                    ReadFileRange(work.files[0], work.offset, work.length, lines);
+                    handOver(0, std::move(lines));
+                } else {
+                    ReadManyFiles(work.files, parsers, manyFileReaders, handOver);
+                }
+            }
+        });
     }
-    bool allDone;
-    do {
-        // Yield the current thread to allow others to run.
-        this_thread::yield();
-        allDone = true;
-        for (const auto& d : done) {
-            allDone &= *d;
-        }
-    } while (!allDone);
 
-    // When done, gather the results.
+    // Each batch is sorted into a run the moment it arrives.
+    vector<vector<string>> runs;
+    auto keepRun = [&runs, spiller, sortType](vector<string>&& batch) {
+        size_t bytes = LineBytes(batch);
+        memoryGovernor.Release(EMemoryUse::Queues, bytes);
+        vector<string> run;
+        {
+            MemoryCharge scratch(EMemoryUse::SortScratch, bytes);
+            run = MergeSortWrapper(std::move(batch), sortType);
+        }
+        if (spiller) spiller->Add(std::move(run));
+        else runs.push_back(std::move(run));
+    };
+    vector<string> batch;
+    while (true) {
+        {
+            unique_lock<mutex> lock(readyMutex);
+            readySignal.wait(lock, [&]() { return queuedBatches > 0 || activeReaders.load() == 0; });
+            if (queuedBatches == 0) break;
+            --queuedBatches;
+        }
+        // A counted batch is in the queue, though one pushed just before it may still be landing.
+        while (!batches.TryPop(batch)) this_thread::yield();
+        keepRun(std::move(batch));
+    }
     for (auto& f : futures) {
-        auto result = f.get();
-        finalList.insert(finalList.end(), result.begin(), result.end());
+        f.get();
     }
+    return runs;
+}
 
-    // Sort the final results and call time.
-    finalList = MergeSortWrapper(finalList, sortType);
-    clock_t endTime = clock();
+// Merges the runs pairwise until one is left. Lines are moved rather than copied and every pair is freed
+// once merged, so the merge costs a second set of string objects, not a second copy of the text.
+vector<string> MergeRuns(vector<vector<string>> runs, ESortType sortType) {
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    while (runs.size() > 1) {
+        vector<vector<string>> merged;
+        for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+            merged.push_back(MergeSortedLists(std::move(runs[i]), std::move(runs[i + 1]), stringComparer.get()));
+        }
+        if (runs.size() % 2 == 1) merged.push_back(std::move(runs.back()));
+        runs.swap(merged);
+    }
+    return runs.empty() ? vector<string>() : std::move(runs.front());
+}
 
-    // Write the results.
-    WriteAndPrint(finalList, outputName, endTime - startTime);
+// k-way merge of in-memory runs, smallest head first, without building the merged list.
+static void MergeRunsInto(const vector<vector<string>>& runs, ESortType sortType, const function<void(const string&)>& emit) {
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    vector<pair<const vector<string>*, size_t>> heads;
+    for (const auto & run : runs) {
+        if (!run.empty()) heads.emplace_back(&run, 0);
+    }
+    auto headIsAfter = [&](const pair<const vector<string>*, size_t>& a, const pair<const vector<string>*, size_t>& b) {
+        return SortsBefore(stringComparer.get(), (*b.first)[b.second], (*a.first)[a.second]);
+    };
+    make_heap(heads.begin(), heads.end(), headIsAfter);
+    while (!heads.empty()) {
+        pop_heap(heads.begin(), heads.end(), headIsAfter);
+        auto& head = heads.back();
+        emit((*head.first)[head.second]);
+        if (++head.second < head.first->size()) push_heap(heads.begin(), heads.end(), headIsAfter);
+        else heads.pop_back();
+    }
+}
+
+// The last merge and the write are one step when the output is mapped or plain or compressed text: the runs
+// are merged straight into the file, and the time reported includes writing it. The runs are charged as
+// lines until written, a spiller hands them over uncharged.
+void MergeWriteAndPrint(vector<vector<string>> runs, const string& outputName, clock_t startTime,
+                        ESortType sortType, const SortOptions& options) {
+    size_t heldBytes = 0, lineCount = 0;
+    for (const auto & run : runs) {
+        heldBytes += LineBytes(run);
+        lineCount += run.size();
+    }
+    MemoryCharge held(EMemoryUse::Lines, heldBytes);
+
+    bool isPlainText = options.format == EOutputFormat::Text && options.shardMethod == EShardMethod::None;
+    if (isPlainText && options.writeMethod == EWriteMethod::Mapped && options.compression == ECompression::None) {
+        vector<const vector<string>*> runPointers;
+        for (const auto & run : runs) runPointers.push_back(&run);
+        if (MergeRunsToMapping(runPointers, OutputPathFor(outputName, options), sortType, options.writerThreads, options.ioMode)) {
+            PrintTime(outputName, int(clock() - startTime));
+            return;
+        }
+    }
+    if (isPlainText && (options.writeMethod == EWriteMethod::Stream || options.compression != ECompression::None)) {
+        string filePath = OutputPathFor(outputName, options);
+        error_code ec;
+        fs::remove(filePath, ec);
+        if (options.compression != ECompression::None) {
+            CompressedSink fileOut(filePath, options.compression, options.compressionLevel, options.ioMode);
+            MergeRunsInto(runs, sortType, [&fileOut](const string& line) {
+                fileOut.Write(line);
+                fileOut.Write("\n", 1);
+            });
+            fileOut.Close();
+        } else {
+            FileSink fileOut(filePath, options.ioMode);
+            MergeRunsInto(runs, sortType, [&fileOut](const string& line) {
+                fileOut.Write(line);
+                fileOut.Write("\n", 1);
+            });
+            fileOut.Close();
+        }
+        PrintTime(outputName, int(clock() - startTime));
+        return;
+    }
+
+    // The other writers need the whole list.
+    vector<string> finalList;
+    {
+        MemoryCharge scratch(EMemoryUse::SortScratch, lineCount * sizeof(string));
+        finalList = MergeRuns(std::move(runs), sortType);
+    }
+    WriteAndPrint(finalList, outputName, int(clock() - startTime), sortType, options);
+}
+
+// Text outputs are streamed from the merge of the spilled runs, and compressed frames are made while it
+// runs. The other writers need the whole list.
+void MergeSpilledWriteAndPrint(RunSpiller& spiller, const string& outputName, clock_t startTime,
+                               ESortType sortType, const SortOptions& options) {
+    spiller.Finish();
+    if (options.format == EOutputFormat::Text && options.shardMethod == EShardMethod::None &&
+        options.compression != ECompression::None) {
+        string filePath = OutputPathFor(outputName, options);
+        error_code ec;
+        fs::remove(filePath, ec);
+        CompressedSink fileOut(filePath, options.compression, options.compressionLevel, options.ioMode);
+        spiller.Merge([&fileOut](const string& line) {
+            fileOut.Write(line);
+            fileOut.Write("\n", 1);
+        });
+        fileOut.Close();
+        PrintTime(outputName, int(clock() - startTime));
+        return;
+    }
+    if (options.format == EOutputFormat::Text && options.shardMethod == EShardMethod::None) {
+        string filePath = OutputPathFor(outputName, options);
+        error_code ec;
+        fs::remove(filePath, ec);
+        FileSink fileOut(filePath, options.ioMode);
+        spiller.Merge([&fileOut](const string& line) {
+            fileOut.Write(line);
+            fileOut.Write("\n", 1);
+        });
+        fileOut.Close();
+        PrintTime(outputName, int(clock() - startTime));
+        return;
+    }
+    vector<string> finalList;
+    spiller.Merge([&finalList](const string& line) { finalList.push_back(line); });
+    WriteAndPrint(finalList, outputName, int(clock() - startTime), sortType, options);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -168,6 +1088,10 @@ bool ContainsSpecial(const string& str) {
 
 vector<string> ReadFile(const string& fileName) {
     vector<string> listOut;
+    if (DetectFileCompression(fileName) != ECompression::None) {
+        ReadCompressedFile(fileName, [&listOut](vector<string>&& lines) { move(lines.begin(), lines.end(), back_inserter(listOut)); });
+        return listOut;
+    }
     ifstream fileIn(fileName);
 
     // Checks for if the file is currently open.
@@ -184,6 +1108,9 @@ vector<string> ReadFile(const string& fileName) {
 
     string line;
     while (getline(fileIn, line)) {
+        // Text mode drops the '\r' of CRLF lines on Windows only, do it everywhere.
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
         // Skip empty lines.
         if (!line.empty()) {
             // Check for special characters or numbers.
@@ -202,159 +1129,4829 @@ vector<string> ReadFile(const string& fileName) {
     return listOut;
 }
 
+// Same line rules as ReadFile, for input that is already in memory.
+void ParseBuffer(const char* data, size_t size, const string& fileName, vector<string>& listOut, vector<string>* rejectedOut) {
+    const char* end = data + size;
+    while (data < end) {
+        const char* newline = static_cast<const char*>(memchr(data, '\n', end - data));
+        const char* lineEnd = newline ? newline : end;
+        // CRLF inputs lose the '\r' here, as they do in ReadFile's text mode reads on Windows.
+        if (lineEnd != data && lineEnd[-1] == '\r') --lineEnd;
 
-
-////// Sorting two words methods
-bool AlphAscStrComp::IsFirstAboveSecond(string firstString, string secondString) {
-    unsigned int i = 0;
-    while (i < firstString.length() && i < secondString.length()) {
-        if (firstString[i] < secondString[i])
-            return true;
-        else if (firstString[i] > secondString[i])
-            return false;
-        ++i;
+        // Skip empty lines.
+        if (lineEnd != data) {
+            string line(data, lineEnd);
+            if (ContainsSpecial(line)) {
+                cerr << "ERROR: special characters or numbers: " << line << " in file: " << fileName << endl;
+                cerr << line << " has been removed" << endl;
+                if (rejectedOut) rejectedOut->push_back(std::move(line));
+            } else {
+                listOut.emplace_back(std::move(line));
+            }
+        }
+        data = newline ? newline + 1 : end;
     }
-    return (firstString.length() < secondString.length());
 }
 
-// Descending String comparer in same format.
-bool AlphDescStrComp::IsFirstAboveSecond(string firstString, string secondString) {
-    unsigned int i = 0;
-    while (i < firstString.length() && i < secondString.length()) {
-        if (firstString[i] > secondString[i])
-            return true;
-        else if (firstString[i] < secondString[i])
-            return false;
-        ++i;
-    }
-    return (secondString.length() < firstString.length());
+// Moves offset forward to the start of the next line, or leaves it if it already is one.
+static size_t AlignToLineStart(const char* data, size_t size, size_t offset) {
+    if (offset == 0 || offset >= size) return min(offset, size);
+    const void* newline = memchr(data + offset - 1, '\n', size - (offset - 1));
+    return newline ? size_t(static_cast<const char*>(newline) - data) + 1 : size;
 }
 
-// Last Letter comparer in different format.
-bool LastLetterAscStrComp::IsFirstAboveSecond(string firstString, string secondString) {
-
-        // Start from the end and work to the front. Loop is designed to rely on return statements.
-    for (auto reverseIt1 = firstString.rbegin(), reverseIt2 = secondString.rbegin(); ;
-         ++reverseIt1, ++reverseIt2) {
+// One huge file is mapped once and cut into chunkCount byte ranges. Every worker moves its start forward to
+// the next line start and stops at the line start at or after its end, so each line is parsed exactly once.
+// onChunk is called on the worker threads, with the chunk's position in the file, as each one finishes.
+void ReadFileChunked(const string& fileName, unsigned int chunkCount, const function<void(size_t, vector<string>&&)>& onChunk) {
+    // Compressed files have no line starts to cut at, they are decoded whole.
+    MappedFile source(fileName);
+    if (!source.IsOpen() || DetectCompression(source.Data(), source.Size()) != ECompression::None) {
+        onChunk(0, ReadFile(fileName));
+        return;
+    }
 
-        // If we reach the beginning of either string, the "prefix" goes first.
-        if (reverseIt1 == firstString.rend()) return true;
-        if (reverseIt2 == secondString.rend()) return false;
+    const char* data = source.Data();
+    size_t size = source.Size();
+    chunkCount = max(1u, chunkCount);
 
-        // If characters are not equal, return comparison result
-        if (*reverseIt1 != *reverseIt2) return *reverseIt1 < *reverseIt2;
+    vector<future<void>> chunks;
+    for (unsigned int i = 0; i < chunkCount; ++i) {
+        size_t rangeStart = size / chunkCount * i;
+        size_t rangeEnd = i + 1 == chunkCount ? size : size / chunkCount * (i + 1);
+        chunks.push_back(async(launch::async, [&, i, rangeStart, rangeEnd]() {
+            size_t start = AlignToLineStart(data, size, rangeStart);
+            size_t end = AlignToLineStart(data, size, rangeEnd);
+            vector<string> lines;
+            if (start < end) {
+                MemoryCharge buffer(EMemoryUse::IoBuffers, end - start);
+                ParseBuffer(data + start, end - start, fileName, lines, nullptr);
+            }
+            onChunk(i, std::move(lines));
+        }));
+    }
+    for (auto& chunk : chunks) {
+        chunk.get();
     }
 }
 
+vector<string> ReadFileChunked(const string& fileName, unsigned int chunkCount) {
+    vector<vector<string>> parts(max(1u, chunkCount));
+    ReadFileChunked(fileName, chunkCount, [&parts](size_t index, vector<string>&& lines) { parts[index] = std::move(lines); });
 
-////// MergeSorting Algorithm
-void merge(vector<string>& originVec, int upper, int mid, int lower, IStringComparer* stringComparer) {
+    // Stitch the chunks back together in file order.
+    size_t total = 0;
+    for (const auto & part : parts) total += part.size();
+    vector<string> listOut;
+    listOut.reserve(total);
+    for (auto& part : parts) {
+        move(part.begin(), part.end(), back_inserter(listOut));
+    }
+    return listOut;
+}
 
-    int i, j, k, upperSize, lowerSize;
+// Parses the lines that start inside [offset, offset + length), by the same rule as ReadFileChunked, so
+// neighbouring ranges of one file together parse every line exactly once.
+void ReadFileRange(const string& fileName, uintmax_t offset, uintmax_t length, vector<string>& listOut) {
+    MappedFile source(fileName);
+    if (!source.IsOpen() || DetectCompression(source.Data(), source.Size()) != ECompression::None) {
+        if (offset == 0) listOut = ReadFile(fileName);
+        return;
+    }
+    const char* data = source.Data();
+    size_t size = source.Size();
+    size_t start = AlignToLineStart(data, size, size_t(offset));
+    size_t end = AlignToLineStart(data, size, size_t(min<uintmax_t>(offset + length, size)));
+    if (start >= end) return;
+    // The range's pages are resident while it is parsed.
+    MemoryCharge buffer(EMemoryUse::IoBuffers, end - start);
+    ParseBuffer(data + start, end - start, fileName, listOut, nullptr);
+}
 
-    // Size of upper and lower sub-arrays.
-    upperSize = mid - upper + 1;
-    lowerSize = lower - mid;
+// Cuts the inputs into ReadUnits and orders them longest first (LPT), so whichever thread is free next
+// takes the biggest piece left. Large files become ranges, small files are grouped for ReadManyFiles.
+// A large compressed file is one unit, streamed through the decoder by whichever reader takes it.
+static void AppendRangeUnits(const InputFile& file, vector<ReadUnit>& units) {
+    if (DetectFileCompression(file.path) != ECompression::None) {
+        ReadUnit unit;
+        unit.files.push_back(file.path);
+        unit.length = unit.bytes = file.size;
+        unit.isRange = unit.isCompressed = true;
+        units.push_back(std::move(unit));
+        return;
+    }
+    for (uintmax_t offset = 0; offset < file.size; offset += READ_SPLIT_BYTES) {
+        ReadUnit unit;
+        unit.files.push_back(file.path);
+        unit.offset = offset;
+        unit.length = min<uintmax_t>(READ_SPLIT_BYTES, file.size - offset);
+        unit.bytes = unit.length;
+        unit.isRange = true;
+        units.push_back(std::move(unit));
+    }
+}
 
-    // Temporary vectors to store upper side and lower side.
-    vector<string> upArray(upperSize), lowArray(lowerSize);
+static bool HasFewerBytes(const ReadUnit& a, const ReadUnit& b) {
+    return a.bytes < b.bytes;
+}
 
-    // Fill the upper sub-array.
-    for(i = 0; i < upperSize; i++)
-        upArray[i] = originVec[upper + i];
+vector<ReadUnit> PlanReads(const vector<InputFile>& inputFiles) {
+    vector<ReadUnit> units;
+    vector<InputFile> smallFiles;
+    for (const auto & file : inputFiles) {
+        if (file.size < CHUNKED_READ_THRESHOLD) smallFiles.push_back(file);
+        else AppendRangeUnits(file, units);
+    }
 
-    // Fill the lower sub-array.
-    for(j = 0; j < lowerSize; j++)
-        lowArray[j] = originVec[mid + 1 + j];
+    // Group small files biggest first, so the groups come out roughly even.
+    stable_sort(smallFiles.begin(), smallFiles.end(), [](const InputFile& a, const InputFile& b) { return a.size > b.size; });
+    ReadUnit group;
+    for (const auto & file : smallFiles) {
+        group.files.push_back(file.path);
+        group.bytes += file.size;
+        if (group.bytes >= READ_BATCH_BYTES) {
+            units.push_back(std::move(group));
+            group = ReadUnit();
+        }
+    }
+    if (!group.files.empty()) units.push_back(std::move(group));
 
-    // Reset indices. Since "upper" is actually our left side (we are reading "top down"),
-    // we set k to equal upper, or the smallest index.
-    i = 0; j = 0; k = upper;
+    stable_sort(units.begin(), units.end(), [](const ReadUnit& a, const ReadUnit& b) { return HasFewerBytes(b, a); });
+    return units;
+}
 
-    // Merge the temporary arrays to the real array.
-    while(i < upperSize && j < lowerSize) {
-        // Here, we invert comparison from traditional Merge Sort methodology to match our...
-        // string comparison methods.
-        if(stringComparer->IsFirstAboveSecond(upArray[i], lowArray[j]))
-            // If upper array element is first, it is placed in the original array,
-            // and we move to the next element in the upper array.
-            originVec[k] = upArray[i++];
-        else
-            // Same logic as above.
-            originVec[k] = lowArray[j++];
+////// Read Scheduler
+// The units are kept as a max-heap on their size.
+void ReadScheduler::Push(ReadUnit unit) {
+    {
+        lock_guard<mutex> lock(schedulerMutex);
+        units.push_back(std::move(unit));
+        push_heap(units.begin(), units.end(), HasFewerBytes);
+    }
+    schedulerSignal.notify_one();
+}
 
-        // k iterates through the whole vector, indicating our point in the original.
-        k++;
+// Large files are split right away. Small ones collect in a group until it is worth a batched read.
+void ReadScheduler::AddFile(const InputFile& file) {
+    {
+        lock_guard<mutex> lock(schedulerMutex);
+        if (file.size >= CHUNKED_READ_THRESHOLD) {
+            size_t first = units.size();
+            AppendRangeUnits(file, units);
+            for (size_t i = first; i < units.size(); ++i) {
+                push_heap(units.begin(), units.begin() + i + 1, HasFewerBytes);
+            }
+        } else {
+            pendingGroup.files.push_back(file.path);
+            pendingGroup.bytes += file.size;
+            if (pendingGroup.bytes < READ_BATCH_BYTES) return;
+            units.push_back(std::move(pendingGroup));
+            push_heap(units.begin(), units.end(), HasFewerBytes);
+            pendingGroup = ReadUnit();
+        }
     }
-    // For any extra element in the upper array.
-    while(i < upperSize) {
-        originVec[k] = upArray[i++];
-        k++;
+    schedulerSignal.notify_all();
+}
+
+void ReadScheduler::Finish() {
+    {
+        lock_guard<mutex> lock(schedulerMutex);
+        if (!pendingGroup.files.empty()) {
+            units.push_back(std::move(pendingGroup));
+            push_heap(units.begin(), units.end(), HasFewerBytes);
+            pendingGroup = ReadUnit();
+        }
+        finished = true;
     }
-    // For any extra element in the lower array.
-    while(j < lowerSize) {
-        originVec[k] = lowArray[j++];
-        k++;
+    schedulerSignal.notify_all();
+}
+
+bool ReadScheduler::Next(ReadUnit& unitOut) {
+    unique_lock<mutex> lock(schedulerMutex);
+    schedulerSignal.wait(lock, [this]() { return finished || !units.empty() || !pendingGroup.files.empty(); });
+    if (!units.empty()) {
+        pop_heap(units.begin(), units.end(), HasFewerBytes);
+        unitOut = std::move(units.back());
+        units.pop_back();
+        return true;
     }
+    // A reader with nothing else to do takes the group that is still filling rather than wait on the producer.
+    if (!pendingGroup.files.empty()) {
+        unitOut = std::move(pendingGroup);
+        pendingGroup = ReadUnit();
+        return true;
+    }
+    return false;
 }
 
-void MergeSort(vector<string>& originVec, int upper, int lower, IStringComparer* stringComparer){
+////// Batched Reading of Many Files
+#if IO_URING_AVAILABLE
+// Minimal io_uring driver over the raw system calls: one submitter, one reaper, both on the calling thread.
+class IoUring {
+public:
+    explicit IoUring(unsigned int depth);
+    ~IoUring();
+    bool IsOpen() const { return ringFd >= 0; }
+    unsigned int Depth() const { return sqEntries; }
+    io_uring_sqe* NextSqe();
+    // Submits everything queued and waits for at least minComplete completions.
+    bool Submit(unsigned int minComplete);
+    // Calls onCompletion(userData, result) for every completion currently available.
+    unsigned int Reap(const function<void(uint64_t, int)>& onCompletion);
 
-    // Base Case. if this is false, subarray has 0-1 elements or is sorted.
-    if (upper < lower) {
-        // Calculate middle index.
-        int mid = upper + (lower - upper) / 2;
+private:
+    int ringFd = -1;
+    unsigned int sqEntries = 0;
+    unsigned int pendingSubmits = 0;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
 
-        // Sort first and second halves through recursive calls.
-        MergeSort(originVec, upper, mid, stringComparer);
-        MergeSort(originVec, mid + 1, lower, stringComparer);
+IoUring::IoUring(unsigned int depth) {
+    io_uring_params params{};
+    ringFd = int(syscall(__NR_io_uring_setup, depth, &params));
+    if (ringFd < 0) return;
 
-        // After halves are sorted, merge morphs the halves into a single sorted array.
-        merge(originVec, upper, mid, lower, stringComparer);
+    sqEntries = params.sq_entries;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = singleMap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ringFd);
+        ringFd = -1;
+        return;
     }
+
+    auto* sq = static_cast<char*>(sqRing);
+    auto* cq = static_cast<char*>(cqRing);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
 }
 
-vector<string> MergeSortWrapper(vector<string> listToSort, ESortType sortType){
-    // Similar switch statement to create stringSorter object depending on the Sort type needed.
-    IStringComparer* stringSorter;
-    switch(sortType) {
-        case ESortType::AlphAsc:
-            stringSorter = new AlphAscStrComp();
-            break;
-        case ESortType::AlphDesc:
-            stringSorter = new AlphDescStrComp();
-            break;
-        case ESortType::LastLetterAsc:
-            stringSorter = new LastLetterAscStrComp();
-            break;
+IoUring::~IoUring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (ringFd >= 0) close(ringFd);
+}
+
+io_uring_sqe* IoUring::NextSqe() {
+    // Only this thread writes the tail, the kernel publishes its progress through the head.
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++pendingSubmits;
+    return sqe;
+}
+
+bool IoUring::Submit(unsigned int minComplete) {
+    int result = int(syscall(__NR_io_uring_enter, ringFd, pendingSubmits, minComplete,
+                             minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    if (result < 0 && errno != EINTR) return false;
+    if (result > 0) pendingSubmits -= unsigned(result);
+    return true;
+}
+
+unsigned int IoUring::Reap(const function<void(uint64_t, int)>& onCompletion) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    for (; head != tail; ++head, ++reaped) {
+        const io_uring_cqe& cqe = cqes[head & *cqMask];
+        onCompletion(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Keeps up to the ring depth of open/read/close requests in flight. Each finished file is handed to
+// onLoaded on this thread. Returns the indices of the files it did not hand over: all of them if the ring
+// cannot be used, the unfinished ones if it fails partway.
+static vector<size_t> LoadFilesWithIoUring(const vector<string>& fileList, const function<void(size_t, string&&)>& onLoaded) {
+    // Files are read in 64 KiB steps. A short read means end of file.
+    const size_t readStep = 64 * 1024;
+    enum EStage : uint64_t { Open = 0, Read = 1, Close = 2 };
+    struct FileState {
+        int fd = -1;
+        string buffer;
+        size_t filled = 0;
+        size_t charged = 0;
+        bool isClosing = false;
+        bool isDone = false;
+    };
+    // Declared before the ring so the buffers outlive any request the ring still holds.
+    vector<FileState> states(fileList.size());
+    vector<size_t> unfinished;
+    IoUring ring(128);
+    if (!ring.IsOpen()) {
+        for (size_t i = 0; i < fileList.size(); ++i) unfinished.push_back(i);
+        return unfinished;
+    }
+    size_t nextFile = 0, finished = 0;
+    unsigned int inFlight = 0;
+    auto userData = [](size_t index, EStage stage) { return uint64_t(index) << 2 | stage; };
+
+    auto queueRead = [&](size_t index) {
+        FileState& state = states[index];
+        state.buffer.resize(state.filled + readStep);
+        memoryGovernor.Charge(EMemoryUse::IoBuffers, readStep);
+        state.charged += readStep;
+        io_uring_sqe* sqe = ring.NextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = state.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(state.buffer.data() + state.filled);
+        sqe->len = unsigned(readStep);
+        sqe->off = state.filled;
+        sqe->user_data = userData(index, Read);
+        ++inFlight;
+    };
+    // Buffers are charged while the ring fills them, the parser charges them again once handed over.
+    auto releaseBuffer = [&](size_t index) {
+        memoryGovernor.Release(EMemoryUse::IoBuffers, states[index].charged);
+        states[index].charged = 0;
+    };
+    auto queueClose = [&](size_t index) {
+        io_uring_sqe* sqe = ring.NextSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = states[index].fd;
+        sqe->user_data = userData(index, Close);
+        states[index].isClosing = true;
+        ++inFlight;
+    };
+    // Anything the ring could not do for one file is redone the ordinary way.
+    auto readDirectly = [&](size_t index) {
+        releaseBuffer(index);
+        ifstream fileIn(fileList[index], ios::binary);
+        if (!fileIn) {
+            cout << "Unable to open file, please close input files: " << fileList[index] << endl;
+        }
+        states[index].buffer.assign(istreambuf_iterator<char>(fileIn), istreambuf_iterator<char>());
+        states[index].isDone = true;
+        onLoaded(index, std::move(states[index].buffer));
+        ++finished;
+    };
+
+    while (finished < fileList.size()) {
+        // Every file needs at most one request in flight, so the ring never overflows.
+        while (nextFile < fileList.size() && inFlight < ring.Depth()) {
+            io_uring_sqe* sqe = ring.NextSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(fileList[nextFile].c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = userData(nextFile, Open);
+            ++nextFile;
+            ++inFlight;
+        }
+        if (!ring.Submit(1)) {
+            // Files already handed over stay handed over. The rest are closed here and left to the caller.
+            for (size_t i = 0; i < fileList.size(); ++i) {
+                if (states[i].isDone) continue;
+                if (states[i].fd >= 0 && !states[i].isClosing) close(states[i].fd);
+                releaseBuffer(i);
+                unfinished.push_back(i);
+            }
+            return unfinished;
+        }
+
+        ring.Reap([&](uint64_t data, int result) {
+            --inFlight;
+            size_t index = size_t(data >> 2);
+            FileState& state = states[index];
+            switch (EStage(data & 3)) {
+                case Open:
+                    if (result < 0) {
+                        readDirectly(index);
+                        return;
+                    }
+                    state.fd = result;
+                    queueRead(index);
+                    return;
+                case Read:
+                    if (result < 0) {
+                        close(state.fd);
+                        readDirectly(index);
+                        return;
+                    }
+                    state.filled += size_t(result);
+                    if (size_t(result) == readStep) {
+                        queueRead(index);
+                        return;
+                    }
+                    state.buffer.resize(state.filled);
+                    queueClose(index);
+                    return;
+                case Close:
+                    releaseBuffer(index);
+                    state.isDone = true;
+                    onLoaded(index, std::move(state.buffer));
+                    ++finished;
+                    return;
+            }
+        });
+    }
+    return unfinished;
+}
+#endif
+
+// Loads and validates many small files with the reads batched: io_uring where the kernel offers it,
+// otherwise blocking reads on the readers pool. Each loaded buffer is parsed on the parsers pool, and
+// onParsed is called there with the file's index in fileList. Callers reading many groups at once share
+// the two pools rather than starting threads per call.
+void ReadManyFiles(const vector<string>& fileList, WorkerPool& parsers, WorkerPool& readers,
+                   const function<void(size_t, vector<string>&&)>& onParsed) {
+    vector<future<void>> parsed;
+    mutex parsedMutex;
+    auto parseLater = [&](size_t index, string&& buffer) {
+        auto shared = make_shared<string>(std::move(buffer));
+        // Loaded files wait for a parser as whole buffers, charged until parsed.
+        memoryGovernor.Charge(EMemoryUse::IoBuffers, shared->size());
+        future<void> task = parsers.Submit([&, index, shared]() {
+            vector<string> lines;
+            ParseInput(shared->data(), shared->size(), fileList[index], lines, nullptr);
+            memoryGovernor.Release(EMemoryUse::IoBuffers, shared->size());
+            onParsed(index, std::move(lines));
+        });
+        lock_guard<mutex> lock(parsedMutex);
+        parsed.push_back(std::move(task));
+    };
+
+    vector<size_t> remaining;
+#if IO_URING_AVAILABLE
+    remaining = LoadFilesWithIoUring(fileList, parseLater);
+#else
+    for (size_t i = 0; i < fileList.size(); ++i) remaining.push_back(i);
+#endif
+    if (!remaining.empty()) {
+        // Portable path for whatever the ring did not load: several blocking reads in flight at once.
+        vector<future<void>> reads;
+        for (size_t i : remaining) {
+            reads.push_back(readers.Submit([&, i]() {
+                ifstream fileIn(fileList[i], ios::binary);
+                if (!fileIn) {
+                    cout << "Unable to open file, please close input files: " << fileList[i] << endl;
+                }
+                parseLater(i, string(istreambuf_iterator<char>(fileIn), istreambuf_iterator<char>()));
+            }));
+        }
+        for (auto& read : reads) read.get();
+    }
+
+    // No more tasks are added once loading is done.
+    for (auto& task : parsed) task.get();
+}
+
+vector<string> ReadManyFiles(const vector<string>& fileList) {
+    WorkerPool parsers(max(1u, thread::hardware_concurrency()));
+    WorkerPool readers(max(4u, thread::hardware_concurrency() * 2));
+    vector<vector<string>> perFile(fileList.size());
+    ReadManyFiles(fileList, parsers, readers, [&perFile](size_t index, vector<string>&& lines) { perFile[index] = std::move(lines); });
+
+    vector<string> listOut;
+    for (auto& lines : perFile) {
+        move(lines.begin(), lines.end(), back_inserter(listOut));
+    }
+    return listOut;
+}
+
+////// Page Cache Friendly I/O
+static const size_t kDirectIoAlignment = 4096;
+static const size_t kSinkBufferBytes = 1024 * 1024;
+// DontNeed sinks drop what they wrote from the cache every time this much more has been written.
+static const uint64_t kDropBehindBytes = 64ull * 1024 * 1024;
+
+AlignedBuffer::AlignedBuffer(size_t bytes) {
+    capacity = (bytes + kDirectIoAlignment - 1) / kDirectIoAlignment * kDirectIoAlignment;
+#if !defined(_WIN32)
+    void* memory = nullptr;
+    if (posix_memalign(&memory, kDirectIoAlignment, max(capacity, kDirectIoAlignment)) == 0) data = static_cast<char*>(memory);
+#else
+    data = static_cast<char*>(_aligned_malloc(max(capacity, kDirectIoAlignment), kDirectIoAlignment));
+#endif
+    if (!data) throw bad_alloc();
+}
+
+AlignedBuffer::~AlignedBuffer() {
+#if !defined(_WIN32)
+    free(data);
+#else
+    _aligned_free(data);
+#endif
+}
+
+// Tells the kernel it may drop cached pages of [offset, offset + length). Dirty pages are flushed first,
+// otherwise the hint is ignored for them.
+static void DropFromPageCache(int fd, uint64_t offset, uint64_t length) {
+#if defined(__linux__)
+    sync_file_range(fd, off_t(offset), off_t(length), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#elif !defined(_WIN32)
+    fdatasync(fd);
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, off_t(offset), off_t(length), POSIX_FADV_DONTNEED);
+#else
+    (void)fd; (void)offset; (void)length;
+#endif
+}
+
+FileSink::FileSink(const string& path, EIoMode ioMode) : mode(ioMode) {
+#if !defined(_WIN32)
+    if (mode == EIoMode::Direct) {
+#if defined(O_DIRECT)
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+#endif
+        // File systems without O_DIRECT (tmpfs, some network mounts) still get the cache-dropping path.
+        if (fd < 0) mode = EIoMode::DontNeed;
+    }
+    if (mode == EIoMode::DontNeed) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#if defined(POSIX_FADV_SEQUENTIAL)
+        if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+    if (fd >= 0) {
+        buffer = make_unique<AlignedBuffer>(kSinkBufferBytes);
+        memoryGovernor.Charge(EMemoryUse::IoBuffers, buffer->Capacity());
+        return;
+    }
+#endif
+    mode = EIoMode::Default;
+    stream.open(path, ios::binary | ios::trunc);
+}
+
+FileSink::~FileSink() {
+    Close();
+    if (buffer) memoryGovernor.Release(EMemoryUse::IoBuffers, buffer->Capacity());
+}
+
+bool FileSink::IsOpen() const {
+    return fd >= 0 || stream.is_open();
+}
+
+void FileSink::Write(const char* data, size_t size) {
+    if (mode == EIoMode::Default) {
+        stream.write(data, streamsize(size));
+        return;
+    }
+    while (size > 0 && !failed) {
+        size_t step = min(size, buffer->Capacity() - filled);
+        memcpy(buffer->Data() + filled, data, step);
+        filled += step;
+        data += step;
+        size -= step;
+        if (filled == buffer->Capacity()) FlushBuffer(false);
+    }
+}
+
+bool FileSink::FlushBuffer(bool isFinal) {
+#if !defined(_WIN32)
+    // O_DIRECT only moves whole aligned blocks, so the last one is padded and the file trimmed afterwards.
+    size_t length = filled;
+    if (mode == EIoMode::Direct && isFinal) {
+        length = (filled + kDirectIoAlignment - 1) / kDirectIoAlignment * kDirectIoAlignment;
+        memset(buffer->Data() + filled, 0, length - filled);
+    }
+    for (size_t done = 0; done < length; ) {
+        ssize_t result = write(fd, buffer->Data() + done, length - done);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            cerr << "ERROR: write failed: " << strerror(errno) << endl;
+            failed = true;
+            return false;
+        }
+        done += size_t(result);
+    }
+    written += filled;
+    filled = 0;
+    if (mode == EIoMode::Direct && isFinal && ftruncate(fd, off_t(written)) != 0) {
+        failed = true;
+    }
+    if (mode == EIoMode::DontNeed && (isFinal || written - droppedUpTo >= kDropBehindBytes)) {
+        DropFromPageCache(fd, droppedUpTo, written - droppedUpTo);
+        droppedUpTo = written;
+    }
+#else
+    (void)isFinal;
+#endif
+    return true;
+}
+
+bool FileSink::Close() {
+    if (mode == EIoMode::Default) {
+        if (stream.is_open()) stream.close();
+        return bool(stream);
+    }
+#if !defined(_WIN32)
+    if (fd < 0) return !failed;
+    FlushBuffer(true);
+    close(fd);
+    fd = -1;
+#endif
+    return !failed;
+}
+
+// Reads and validates a whole input file with the requested page cache behaviour.
+vector<string> ReadFileWithMode(const string& fileName, EIoMode ioMode) {
+#if !defined(_WIN32)
+    if (ioMode != EIoMode::Default) {
+        int fd = -1;
+        bool isDirect = false;
+#if defined(O_DIRECT)
+        if (ioMode == EIoMode::Direct) {
+            fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+            isDirect = fd >= 0;
+        }
+#endif
+        if (fd < 0) fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info{};
+        if (fd >= 0 && fstat(fd, &info) == 0) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+            if (!isDirect) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            // Direct reads also need whole blocks, the buffer is rounded up and the read stops short at EOF.
+            AlignedBuffer contents(size_t(info.st_size) + kDirectIoAlignment);
+            size_t filled = 0;
+            bool failed = false;
+            while (true) {
+                size_t want = contents.Capacity() - filled;
+                if (want == 0) break;
+                ssize_t result = read(fd, contents.Data() + filled, want);
+                if (result < 0 && errno == EINTR) continue;
+                if (result < 0) failed = true;
+                if (result <= 0) break;
+                filled += size_t(result);
+            }
+            if (!isDirect) DropFromPageCache(fd, 0, uint64_t(info.st_size));
+            close(fd);
+            if (!failed) {
+                vector<string> lines;
+                ParseInput(contents.Data(), filled, fileName, lines, nullptr);
+                return lines;
+            }
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+#else
+    (void)ioMode;
+#endif
+    return ReadInputFile(fileName);
+}
+
+// Picks the chunked reader for files large enough to benefit from it.
+vector<string> ReadInputFile(const string& fileName) {
+    error_code ec;
+    uintmax_t size = fs::file_size(fileName, ec);
+    if (!ec && size >= CHUNKED_READ_THRESHOLD && DetectFileCompression(fileName) == ECompression::None) {
+        return ReadFileChunked(fileName, max(2u, thread::hardware_concurrency()));
+    }
+    return ReadFile(fileName);
+}
+
+////// Compressed Input
+// Decompressed text is handed on in pieces of about this size, so sorting starts long before the end.
+static const size_t kDecodeStepBytes = 4 * 1024 * 1024;
+
+ECompression DetectCompression(const char* data, size_t size) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B) return ECompression::Gzip;
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD) return ECompression::Zstd;
+    return ECompression::None;
+}
+
+ECompression DetectFileCompression(const string& fileName) {
+    char magic[4] = {};
+    ifstream fileIn(fileName, ios::binary);
+    fileIn.read(magic, sizeof(magic));
+    return DetectCompression(magic, size_t(fileIn.gcount()));
+}
+
+// Calls onOutput with the decompressed bytes in order. Gzip input may hold several members back to back,
+// zstd input several frames.
+static bool DecodeStream(const char* data, size_t size, ECompression compression, const function<void(const char*, size_t)>& onOutput) {
+    vector<char> out(256 * 1024);
+    switch (compression) {
+#if defined(ZLIB_AVAILABLE)
+        case ECompression::Gzip: {
+            z_stream stream{};
+            if (inflateInit2(&stream, 15 + 16) != Z_OK) return false;
+            size_t fed = 0;
+            bool succeeded = false;
+            while (true) {
+                // avail_in is 32-bit, so very large inputs are fed in steps.
+                if (stream.avail_in == 0 && fed < size) {
+                    size_t step = min<size_t>(size - fed, size_t(1) << 30);
+                    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + fed));
+                    stream.avail_in = uInt(step);
+                    fed += step;
+                }
+                stream.next_out = reinterpret_cast<Bytef*>(out.data());
+                stream.avail_out = uInt(out.size());
+                int result = inflate(&stream, Z_NO_FLUSH);
+                size_t produced = out.size() - stream.avail_out;
+                if (produced > 0) onOutput(out.data(), produced);
+                if (result == Z_STREAM_END) {
+                    if (stream.avail_in == 0 && fed == size) {
+                        succeeded = true;
+                        break;
+                    }
+                    inflateReset(&stream);
+                } else if (result != Z_OK) {
+                    break;
+                }
+            }
+            inflateEnd(&stream);
+            return succeeded;
+        }
+#endif
+#if defined(ZSTD_AVAILABLE)
+        case ECompression::Zstd: {
+            ZSTD_DCtx* context = ZSTD_createDCtx();
+            if (!context) return false;
+            ZSTD_inBuffer input{ data, size, 0 };
+            size_t result = 0;
+            bool outputFilled = true;
+            while (input.pos < input.size || outputFilled) {
+                ZSTD_outBuffer output{ out.data(), out.size(), 0 };
+                result = ZSTD_decompressStream(context, &output, &input);
+                if (ZSTD_isError(result)) break;
+                if (output.pos > 0) onOutput(out.data(), output.pos);
+                outputFilled = output.pos == output.size;
+                // Calling again after the last frame ended would start reading a new one.
+                if (result == 0 && input.pos == input.size) break;
+            }
+            ZSTD_freeDCtx(context);
+            // Zero means the last frame was complete.
+            return result == 0;
+        }
+#endif
         default:
-            cerr << "ERROR: Unknown sort type in MergeSortWrapper. defaulting to AlphAsc" << endl;
-            stringSorter = new AlphAscStrComp();
-            break;
+            return false;
     }
+}
 
-    // After finding the correct sorting method, we pass the list and the method to MergeSort.
-    MergeSort(listToSort, 0, listToSort.size() - 1, stringSorter);
+// Byte spans of frames that decode independently: zstd frames, or the blocks of a BGZF file (gzip members
+// carrying their own size in a "BC" extra field). Empty when the input cannot be split that way.
+static vector<pair<size_t, size_t>> FindIndependentFrames(const char* data, size_t size, ECompression compression) {
+    vector<pair<size_t, size_t>> frames;
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t position = 0;
+    while (position < size) {
+        size_t frameSize = 0;
+        if (compression == ECompression::Gzip) {
+            // Fixed header, then XLEN and the extra subfields, present only when FLG.FEXTRA is set.
+            const unsigned char* header = bytes + position;
+            if (size - position < 12 || header[0] != 0x1F || header[1] != 0x8B || !(header[3] & 0x04)) return {};
+            size_t extraLength = size_t(header[10]) | size_t(header[11]) << 8;
+            if (size - position < 12 + extraLength) return {};
+            for (size_t field = 12; field + 4 <= 12 + extraLength; ) {
+                size_t fieldLength = size_t(header[field + 2]) | size_t(header[field + 3]) << 8;
+                if (header[field] == 'B' && header[field + 1] == 'C' && fieldLength == 2 && field + 6 <= 12 + extraLength) {
+                    frameSize = (size_t(header[field + 4]) | size_t(header[field + 5]) << 8) + 1;
+                }
+                field += 4 + fieldLength;
+            }
+        } else {
+#if defined(ZSTD_AVAILABLE)
+            size_t result = ZSTD_findFrameCompressedSize(data + position, size - position);
+            if (!ZSTD_isError(result)) frameSize = result;
+#endif
+        }
+        if (frameSize == 0 || frameSize > size - position) return {};
+        frames.emplace_back(position, frameSize);
+        position += frameSize;
+    }
+    return frames;
+}
 
-    // Delete the object to avoid memory leaks.
-    delete stringSorter;
-    return listToSort;
+// Decompresses a whole compressed input and calls onText with the text in order, every piece ending at a
+// line end except perhaps the last. Inputs made of independent frames are decoded several frames at a time
+// on worker threads, anything else streams through one decoder.
+bool DecodeCompressedInput(const char* data, size_t size, const string& fileName, const function<void(const char*, size_t)>& onText) {
+    ECompression compression = DetectCompression(data, size);
+#if !defined(ZLIB_AVAILABLE)
+    if (compression == ECompression::Gzip) {
+        cerr << "ERROR: gzip input but this build has no zlib: " << fileName << endl;
+        return false;
+    }
+#endif
+#if !defined(ZSTD_AVAILABLE)
+    if (compression == ECompression::Zstd) {
+        cerr << "ERROR: zstd input but this build has no zstd: " << fileName << endl;
+        return false;
+    }
+#endif
+
+    // Text is held back until it ends on a line, so no line is ever split between two pieces.
+    string pending;
+    auto deliver = [&pending, &onText](bool isFinal) {
+        size_t lastNewline = pending.rfind('\n');
+        size_t cut = isFinal ? pending.size() : lastNewline == string::npos ? 0 : lastNewline + 1;
+        if (cut == 0) return;
+        onText(pending.data(), cut);
+        pending.erase(0, cut);
+    };
+
+    bool succeeded = true;
+    vector<pair<size_t, size_t>> frames = FindIndependentFrames(data, size, compression);
+    if (frames.size() > 1) {
+        size_t groupSize = size_t(max(2u, thread::hardware_concurrency())) * 2;
+        for (size_t first = 0; first < frames.size() && succeeded; first += groupSize) {
+            size_t count = min(groupSize, frames.size() - first);
+            vector<string> decoded(count);
+            vector<future<bool>> decoders;
+            for (size_t i = 0; i < count; ++i) {
+                decoders.push_back(async(launch::async, [&, i]() {
+                    const auto& frame = frames[first + i];
+                    return DecodeStream(data + frame.first, frame.second, compression,
+                                        [&decoded, i](const char* text, size_t length) { decoded[i].append(text, length); });
+                }));
+            }
+            for (size_t i = 0; i < count; ++i) {
+                succeeded &= decoders[i].get();
+                pending += decoded[i];
+                decoded[i] = string();
+            }
+            deliver(false);
+        }
+    } else {
+        succeeded = DecodeStream(data, size, compression, [&](const char* text, size_t length) {
+            pending.append(text, length);
+            if (pending.size() >= kDecodeStepBytes) deliver(false);
+        });
+    }
+    deliver(true);
+
+    if (!succeeded) {
+        cerr << "ERROR: compressed input is damaged or truncated: " << fileName << endl;
+    }
+    return succeeded;
 }
 
+// ParseBuffer for whole input files, which may arrive compressed.
+void ParseInput(const char* data, size_t size, const string& fileName, vector<string>& listOut, vector<string>* rejectedOut) {
+    if (DetectCompression(data, size) == ECompression::None) {
+        ParseBuffer(data, size, fileName, listOut, rejectedOut);
+        return;
+    }
+    DecodeCompressedInput(data, size, fileName, [&](const char* text, size_t length) {
+        ParseBuffer(text, length, fileName, listOut, rejectedOut);
+    });
+}
 
-////// Output
-void WriteAndPrint(const vector<string>& finalList, const string& outputName, int clockCounter) {
+// Streams a compressed file through the decoder, validating each decoded piece and handing its lines on
+// right away.
+bool ReadCompressedFile(const string& fileName, const function<void(vector<string>&&)>& onLines) {
+    MappedFile source(fileName);
+    if (!source.IsOpen()) {
+        cout << "Unable to open file, please close input files: " << fileName << endl;
+        return false;
+    }
+    return DecodeCompressedInput(source.Data(), source.Size(), fileName, [&](const char* text, size_t length) {
+        vector<string> lines;
+        ParseBuffer(text, length, fileName, lines, nullptr);
+        onLines(std::move(lines));
+    });
+}
 
-    // Track the times for testing
-    cout << endl << outputName << "\t- Time Taken (clocks): " << clockCounter << endl;
+// 64-bit FNV-1a. Pass the previous result as the seed to hash data in pieces.
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed) {
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
 
-    // Output directory and file pathing.
-    const std::string outputDirectory = "../OutputText/";
-    std::string filePath = outputDirectory + outputName + ".txt";
 
-    ofstream fileOut(filePath, ofstream::trunc);
-    for (const auto & i : finalList) {
-        fileOut << i << endl;
+////// Mapped Files
+MappedFile::MappedFile(const string& path) {
+#if !defined(_WIN32)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat info{};
+    if (fstat(fd, &info) == 0) {
+        size = size_t(info.st_size);
+        auto sinceEpoch = chrono::seconds(info.st_mtim.tv_sec) + chrono::nanoseconds(info.st_mtim.tv_nsec);
+        auto systemTime = chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(sinceEpoch));
+        modified = int64_t(chrono::file_clock::from_sys(systemTime).time_since_epoch().count());
+        if (size == 0) {
+            isOpen = true;
+        } else {
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data = static_cast<const char*>(mapping);
+                isOpen = isMapped = true;
+            }
+        }
+    }
+    close(fd);
+    if (isOpen) return;
+#endif
+
+    // No mmap available, fall back to reading the whole file.
+    error_code ec;
+    modified = int64_t(fs::last_write_time(path, ec).time_since_epoch().count());
+    ifstream fileIn(path, ios::binary);
+    if (!fileIn) return;
+    buffer.assign(istreambuf_iterator<char>(fileIn), istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+    isOpen = true;
+}
+
+MappedFile::~MappedFile() {
+#if !defined(_WIN32)
+    if (isMapped) {
+        munmap(const_cast<char*>(data), size);
+    }
+#endif
+}
+
+bool WritableMapping::Create(const string& path, size_t fileSize) {
+#if !defined(_WIN32)
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    size = fileSize;
+    if (size == 0) return true;
+
+    // Unlike ftruncate, posix_fallocate gives up before mapping if the disk cannot hold the file.
+    void* mapping = MAP_FAILED;
+    if (posix_fallocate(fd, 0, off_t(size)) == 0) {
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        fs::remove(path);
+        return false;
+    }
+    data = static_cast<char*>(mapping);
+#if defined(MADV_SEQUENTIAL)
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+    return true;
+#else
+    (void)path; (void)fileSize;
+    return false;
+#endif
+}
+
+// Unmaps and closes. With io=dontneed the pages are written back and dropped from the cache first.
+bool WritableMapping::Close(EIoMode ioMode) {
+    bool succeeded = true;
+#if !defined(_WIN32)
+    if (data) {
+        if (ioMode == EIoMode::DontNeed && msync(data, size, MS_SYNC) != 0) succeeded = false;
+        munmap(data, size);
+        data = nullptr;
+    }
+    if (fd >= 0) {
+        if (ioMode == EIoMode::DontNeed) DropFromPageCache(fd, 0, size);
+        if (close(fd) != 0) succeeded = false;
+        fd = -1;
+    }
+#else
+    (void)ioMode;
+#endif
+    return succeeded;
+}
+
+WritableMapping::~WritableMapping() {
+    Close(EIoMode::Default);
+}
+
+
+////// Parsed File Cache
+// Cache file layout, all integers little-endian as written by this machine:
+//   ParsedCacheHeader
+//   source path bytes (pathLength)
+//   uint64 offsets[lineCount + 1]            into the line bytes
+//   line bytes                               contiguous, no separators
+//   uint64 rejectedOffsets[rejectedCount + 1]
+//   rejected line bytes
+struct ParsedCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;
+    int64_t sourceModified;
+    uint64_t contentHash;
+    uint64_t pathLength;
+    uint64_t lineCount;
+    uint64_t rejectedCount;
+};
+
+static const char kParsedCacheMagic[4] = { 'T', 'F', 'P', 'C' };
+
+static int64_t ModifiedTimeOf(const string& fileName, error_code& ec) {
+    return int64_t(fs::last_write_time(fileName, ec).time_since_epoch().count());
+}
+
+string ParsedFileCache::CachePathFor(const string& fileName) const {
+    string key = fs::weakly_canonical(fileName).string();
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tfpc", (unsigned long long)HashBytes(key.data(), key.size()));
+    return (fs::path(cacheDirectory) / name).string();
+}
+
+bool ParsedFileCache::Load(const string& fileName, CachedFileLines& out) {
+    error_code ec;
+    uint64_t sourceSize = fs::file_size(fileName, ec);
+    if (ec) return false;
+    int64_t sourceModified = ModifiedTimeOf(fileName, ec);
+    if (ec) return false;
+
+    string cachePath = CachePathFor(fileName);
+    if (!fs::exists(cachePath, ec)) return false;
+    auto mapping = make_shared<MappedFile>(cachePath);
+    if (!mapping->IsOpen() || mapping->Size() < sizeof(ParsedCacheHeader)) return false;
+
+    ParsedCacheHeader header{};
+    memcpy(&header, mapping->Data(), sizeof(header));
+    const char* cursor = mapping->Data() + sizeof(header);
+    const char* end = mapping->Data() + mapping->Size();
+    if (memcmp(header.magic, kParsedCacheMagic, 4) != 0 || header.version != 1 || header.sourceSize != sourceSize) {
+        return false;
+    }
+
+    // The stored path guards against two sources hashing to the same cache name.
+    string key = fs::weakly_canonical(fileName).string();
+    if (header.pathLength != key.size() || size_t(end - cursor) < key.size() || memcmp(cursor, key.data(), key.size()) != 0) {
+        return false;
+    }
+    cursor += header.pathLength;
+
+    // A damaged or truncated entry is a miss: the offsets must start at zero, never decrease and stay
+    // inside the line bytes.
+    if (header.lineCount >= size_t(end - cursor) / sizeof(uint64_t)) return false;
+    size_t offsetBytes = size_t(header.lineCount + 1) * sizeof(uint64_t);
+    vector<uint64_t> offsets(header.lineCount + 1);
+    memcpy(offsets.data(), cursor, offsetBytes);
+    cursor += offsetBytes;
+    if (offsets.front() != 0 || !is_sorted(offsets.begin(), offsets.end()) || size_t(end - cursor) < offsets.back()) return false;
+
+    // Same size but touched since: only trust the entry if the content still hashes the same, and then
+    // record the new mtime so later loads skip the hash.
+    if (header.sourceModified != sourceModified) {
+        MappedFile source(fileName);
+        if (!source.IsOpen() || HashBytes(source.Data(), source.Size()) != header.contentHash) return false;
+        header.sourceModified = sourceModified;
+        fstream headerOut(cachePath, ios::binary | ios::in | ios::out);
+        headerOut.write(reinterpret_cast<const char*>(&header), sizeof(header));
     }
-    fileOut.close();
+
+    out.lines.clear();
+    out.lines.reserve(header.lineCount);
+    for (uint64_t i = 0; i < header.lineCount; ++i) {
+        out.lines.emplace_back(cursor + offsets[i], size_t(offsets[i + 1] - offsets[i]));
+    }
+    out.rejectedCount = header.rejectedCount;
+    out.mapping = mapping;
+    return true;
+}
+
+// Size, mtime and content hash all come from the mapping the lines were parsed from, so a file replaced
+// in between cannot be recorded with another file's identity.
+void ParsedFileCache::Store(const string& fileName, const MappedFile& source, const vector<string>& lines, const vector<string>& rejected) {
+    error_code ec;
+    fs::create_directories(cacheDirectory, ec);
+
+    ParsedCacheHeader header{};
+    memcpy(header.magic, kParsedCacheMagic, 4);
+    header.version = 1;
+    header.sourceSize = source.Size();
+    header.sourceModified = source.Modified();
+    string key = fs::weakly_canonical(fileName).string();
+    header.contentHash = HashBytes(source.Data(), source.Size());
+    header.pathLength = key.size();
+    header.lineCount = lines.size();
+    header.rejectedCount = rejected.size();
+
+    // Write next to the final name and rename, so a concurrent reader never sees a partial entry.
+    string cachePath = CachePathFor(fileName);
+    string tempPath = cachePath + ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()));
+    ofstream cacheOut(tempPath, ios::binary | ios::trunc);
+    cacheOut.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    cacheOut.write(key.data(), streamsize(key.size()));
+    for (const vector<string>* group : { &lines, &rejected }) {
+        uint64_t offset = 0;
+        cacheOut.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        for (const auto & line : *group) {
+            offset += line.size();
+            cacheOut.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        }
+        for (const auto & line : *group) {
+            cacheOut.write(line.data(), streamsize(line.size()));
+        }
+    }
+    cacheOut.close();
+    if (!cacheOut) {
+        fs::remove(tempPath, ec);
+        return;
+    }
+    fs::rename(tempPath, cachePath, ec);
+}
+
+// A hit hands out views into the cache file's mapping, so the lines are only copied once, into the job.
+shared_ptr<const CachedFileLines> ParsedFileCache::Read(const string& fileName) {
+    auto cached = make_shared<CachedFileLines>();
+    if (Load(fileName, *cached)) {
+        if (cached->rejectedCount > 0) {
+            cerr << "ERROR: " << cached->rejectedCount << " line(s) with special characters or numbers removed from file: "
+                 << fileName << " (cached)" << endl;
+        }
+        return cached;
+    }
+
+    // Miss: parse from one mapping so the content hash comes from the same bytes as the lines.
+    MappedFile source(fileName);
+    if (!source.IsOpen()) {
+        cached->owned = ReadFile(fileName);
+    } else {
+        vector<string> rejected;
+        ParseInput(source.Data(), source.Size(), fileName, cached->owned, &rejected);
+        Store(fileName, source, cached->owned, rejected);
+    }
+    cached->lines.assign(cached->owned.begin(), cached->owned.end());
+    return cached;
+}
+
+
+
+////// Sorting two words methods
+bool AlphAscStrComp::IsFirstAboveSecond(string firstString, string secondString) {
+    unsigned int i = 0;
+    while (i < firstString.length() && i < secondString.length()) {
+        if (firstString[i] < secondString[i])
+            return true;
+        else if (firstString[i] > secondString[i])
+            return false;
+        ++i;
+    }
+    return (firstString.length() < secondString.length());
+}
+
+// Descending String comparer in same format.
+bool AlphDescStrComp::IsFirstAboveSecond(string firstString, string secondString) {
+    unsigned int i = 0;
+    while (i < firstString.length() && i < secondString.length()) {
+        if (firstString[i] > secondString[i])
+            return true;
+        else if (firstString[i] < secondString[i])
+            return false;
+        ++i;
+    }
+    return (secondString.length() < firstString.length());
+}
+
+// Last Letter comparer in different format.
+bool LastLetterAscStrComp::IsFirstAboveSecond(string firstString, string secondString) {
+
+        // Start from the end and work to the front. Loop is designed to rely on return statements.
+    for (auto reverseIt1 = firstString.rbegin(), reverseIt2 = secondString.rbegin(); ;
+         ++reverseIt1, ++reverseIt2) {
+
+        // If we reach the beginning of either string, the "prefix" goes first.
+        if (reverseIt1 == firstString.rend()) return true;
+        if (reverseIt2 == secondString.rend()) return false;
+
+        // If characters are not equal, return comparison result
+        if (*reverseIt1 != *reverseIt2) return *reverseIt1 < *reverseIt2;
+    }
+}
+
+
+////// MergeSorting Algorithm
+void merge(vector<string>& originVec, int upper, int mid, int lower, IStringComparer* stringComparer) {
+
+    int i, j, k, upperSize, lowerSize;
+
+    // Size of upper and lower sub-arrays.
+    upperSize = mid - upper + 1;
+    lowerSize = lower - mid;
+
+    // Temporary vectors to store upper side and lower side.
+    vector<string> upArray(upperSize), lowArray(lowerSize);
+
+    // Fill the upper sub-array.
+    for(i = 0; i < upperSize; i++)
+        upArray[i] = originVec[upper + i];
+
+    // Fill the lower sub-array.
+    for(j = 0; j < lowerSize; j++)
+        lowArray[j] = originVec[mid + 1 + j];
+
+    // Reset indices. Since "upper" is actually our left side (we are reading "top down"),
+    // we set k to equal upper, or the smallest index.
+    i = 0; j = 0; k = upper;
+
+    // Merge the temporary arrays to the real array.
+    while(i < upperSize && j < lowerSize) {
+        // Here, we invert comparison from traditional Merge Sort methodology to match our...
+        // string comparison methods.
+        if(stringComparer->IsFirstAboveSecond(upArray[i], lowArray[j]))
+            // If upper array element is first, it is placed in the original array,
+            // and we move to the next element in the upper array.
+            originVec[k] = upArray[i++];
+        else
+            // Same logic as above.
+            originVec[k] = lowArray[j++];
+
+        // k iterates through the whole vector, indicating our point in the original.
+        k++;
+    }
+    // For any extra element in the upper array.
+    while(i < upperSize) {
+        originVec[k] = upArray[i++];
+        k++;
+    }
+    // For any extra element in the lower array.
+    while(j < lowerSize) {
+        originVec[k] = lowArray[j++];
+        k++;
+    }
+}
+
+void MergeSort(vector<string>& originVec, int upper, int lower, IStringComparer* stringComparer){
+
+    // Base Case. if this is false, subarray has 0-1 elements or is sorted.
+    if (upper < lower) {
+        // Calculate middle index.
+        int mid = upper + (lower - upper) / 2;
+
+        // Sort first and second halves through recursive calls.
+        MergeSort(originVec, upper, mid, stringComparer);
+        MergeSort(originVec, mid + 1, lower, stringComparer);
+
+        // After halves are sorted, merge morphs the halves into a single sorted array.
+        merge(originVec, upper, mid, lower, stringComparer);
+    }
+}
+
+unique_ptr<IStringComparer> MakeComparer(ESortType sortType) {
+    // Similar switch statement to create stringSorter object depending on the Sort type needed.
+    switch(sortType) {
+        case ESortType::AlphAsc:
+            return make_unique<AlphAscStrComp>();
+        case ESortType::AlphDesc:
+            return make_unique<AlphDescStrComp>();
+        case ESortType::LastLetterAsc:
+            return make_unique<LastLetterAscStrComp>();
+        default:
+            cerr << "ERROR: Unknown sort type in MakeComparer. defaulting to AlphAsc" << endl;
+            return make_unique<AlphAscStrComp>();
+    }
+}
+
+vector<string> MergeSortWrapper(vector<string> listToSort, ESortType sortType){
+    // After finding the correct sorting method, we pass the list and the method to MergeSort.
+    // unique_ptr deletes the object to avoid memory leaks.
+    unique_ptr<IStringComparer> stringSorter = MakeComparer(sortType);
+    MergeSort(listToSort, 0, int(listToSort.size()) - 1, stringSorter.get());
+    return listToSort;
+}
+
+
+////// Merging already sorted lists
+vector<string> MergeSortedLists(const vector<string>& first, const vector<string>& second, IStringComparer* stringComparer) {
+    vector<string> merged;
+    merged.reserve(first.size() + second.size());
+    size_t i = 0, j = 0;
+    while (i < first.size() && j < second.size()) {
+        // Ties take from the first list, so merging keeps the order of equal elements stable.
+        if (stringComparer->IsFirstAboveSecond(second[j], first[i]) && second[j] != first[i])
+            merged.push_back(second[j++]);
+        else
+            merged.push_back(first[i++]);
+    }
+    merged.insert(merged.end(), first.begin() + i, first.end());
+    merged.insert(merged.end(), second.begin() + j, second.end());
+    return merged;
+}
+
+// Same merge for lists the caller is done with: the lines are moved across and both lists are left empty.
+vector<string> MergeSortedLists(vector<string>&& first, vector<string>&& second, IStringComparer* stringComparer) {
+    vector<string> merged;
+    merged.reserve(first.size() + second.size());
+    size_t i = 0, j = 0;
+    while (i < first.size() && j < second.size()) {
+        if (stringComparer->IsFirstAboveSecond(second[j], first[i]) && second[j] != first[i])
+            merged.push_back(std::move(second[j++]));
+        else
+            merged.push_back(std::move(first[i++]));
+    }
+    move(first.begin() + i, first.end(), back_inserter(merged));
+    move(second.begin() + j, second.end(), back_inserter(merged));
+    vector<string>().swap(first);
+    vector<string>().swap(second);
+    return merged;
+}
+
+
+////// Output
+void WriteAndPrint(const vector<string>& finalList, const string& outputName, int clockCounter,
+                   ESortType sortType, const SortOptions& options) {
+
+    // Track the times for testing
+    PrintTime(outputName, clockCounter);
+
+    // Output directory and file pathing.
+    std::string filePath = OutputPathFor(outputName, options);
+
+    if (options.shardMethod != EShardMethod::None) {
+        WriteShardedOutput(finalList, filePath, sortType, options);
+        return;
+    }
+
+    switch (options.format) {
+        case EOutputFormat::Indexed:
+            WriteIndexedOutput(finalList, filePath, sortType, options.ioMode);
+            break;
+        case EOutputFormat::FrontCoded:
+            WriteFrontCodedOutput(finalList, filePath, sortType, options.ioMode);
+            break;
+        default:
+            if (options.compression != ECompression::None) {
+                WriteCompressedLines(finalList, 0, finalList.size(), filePath, options);
+                break;
+            }
+            if (options.writeMethod == EWriteMethod::Pwrite &&
+                WriteLinesParallel(finalList, filePath, options.writerThreads, options.ioMode)) {
+                break;
+            }
+            if (options.writeMethod == EWriteMethod::Mapped &&
+                MergeRunsToMapping({ &finalList }, filePath, sortType, options.writerThreads, options.ioMode)) {
+                break;
+            }
+            WriteLines(finalList, filePath, options.ioMode);
+            break;
+    }
+}
+
+void WriteLines(const vector<string>& lines, const string& filePath, EIoMode ioMode) {
+    WriteLines(lines, 0, lines.size(), filePath, ioMode);
+}
+
+// Writes lines [from, to) only.
+void WriteLines(const vector<string>& lines, size_t from, size_t to, const string& filePath, EIoMode ioMode) {
+    // Replace rather than truncate, the old file may be a hard link into the result cache.
+    error_code ec;
+    fs::remove(filePath, ec);
+
+    FileSink fileOut(filePath, ioMode);
+    for (size_t i = from; i < to; ++i) {
+        fileOut.Write(lines[i]);
+        fileOut.Write("\n", 1);
+    }
+    fileOut.Close();
+}
+
+////// Parallel Output
+// Partitions smaller than this are not worth a thread of their own.
+static const uint64_t kMinWritePartitionBytes = 4ull * 1024 * 1024;
+
+// Writes all of [data, data + size) at offset, retrying short writes.
+static bool PwriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+#if !defined(_WIN32)
+    while (size > 0) {
+        ssize_t result = pwrite(fd, data, size, off_t(offset));
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return false;
+        data += result;
+        size -= size_t(result);
+        offset += uint64_t(result);
+    }
+    return true;
+#else
+    (void)fd; (void)data; (void)size; (void)offset;
+    return false;
+#endif
+}
+
+// The sorted lines are cut into partitions of about equal bytes. A prefix sum over the line lengths gives
+// every partition its byte offset, so the file is preallocated to its final size and each worker pwrites
+// its own partition in place. Returns false, having written nothing, when the file cannot be written
+// this way, e.g. with io=direct, whose transfers must start on block boundaries.
+bool WriteLinesParallel(const vector<string>& lines, const string& filePath, unsigned int writerCount, EIoMode ioMode) {
+#if !defined(_WIN32)
+    if (ioMode == EIoMode::Direct) return false;
+
+    uint64_t totalBytes = 0;
+    for (const auto & line : lines) totalBytes += line.size() + 1;
+    uint64_t partitionCount = max<uint64_t>(1, min<uint64_t>(max(1u, writerCount), totalBytes / kMinWritePartitionBytes));
+
+    // Partition p covers lines [firstLine[p], firstLine[p + 1]) and starts at byte startOffset[p].
+    vector<size_t> firstLine{ 0 };
+    vector<uint64_t> startOffset{ 0 };
+    uint64_t offset = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        offset += lines[i].size() + 1;
+        if (firstLine.size() < partitionCount && offset >= totalBytes / partitionCount * firstLine.size()) {
+            firstLine.push_back(i + 1);
+            startOffset.push_back(offset);
+        }
+    }
+    firstLine.push_back(lines.size());
+    startOffset.push_back(totalBytes);
+
+    // Replace rather than truncate, the old file may be a hard link into the result cache.
+    error_code ec;
+    fs::remove(filePath, ec);
+    int fd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    // Reserving the blocks up front keeps the extents contiguous and the writers off the allocator.
+    if (totalBytes > 0 && posix_fallocate(fd, 0, off_t(totalBytes)) != 0 && ftruncate(fd, off_t(totalBytes)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    atomic<int> writeError(0);
+    vector<future<void>> writers;
+    for (size_t p = 0; p + 1 < firstLine.size(); ++p) {
+        writers.push_back(async(launch::async, [&, p]() {
+            // Lines are gathered into a local buffer so each pwrite moves a large block.
+            string buffer;
+            buffer.reserve(kSinkBufferBytes);
+            uint64_t position = startOffset[p];
+            for (size_t i = firstLine[p]; i < firstLine[p + 1] && writeError == 0; ++i) {
+                buffer.append(lines[i]);
+                buffer.push_back('\n');
+                if (buffer.size() >= kSinkBufferBytes || i + 1 == firstLine[p + 1]) {
+                    if (!PwriteAll(fd, buffer.data(), buffer.size(), position)) writeError = errno ? errno : EIO;
+                    position += buffer.size();
+                    buffer.clear();
+                }
+            }
+            if (ioMode == EIoMode::DontNeed) DropFromPageCache(fd, startOffset[p], startOffset[p + 1] - startOffset[p]);
+        }));
+    }
+    for (auto& writer : writers) writer.get();
+
+    if (writeError != 0) cerr << "ERROR: write failed: " << filePath << ": " << strerror(writeError) << endl;
+    close(fd);
+    return true;
+#else
+    (void)lines; (void)filePath; (void)writerCount; (void)ioMode;
+    return false;
+#endif
+}
+
+////// Mapped Output
+// The output is cut into partitions by splitter keys taken at even steps through the largest run. Every run
+// is cut at the same keys, so equal lines fall in one partition and the partitions follow each other in sort
+// order. Each worker first counts its partition's bytes, a prefix sum turns those into file offsets, then the
+// worker k-way merges its slices of the runs directly into the mapping. With one run this is a parallel copy.
+// Returns false, having written nothing, if the file could not be mapped, as with io=direct.
+bool MergeRunsToMapping(const vector<const vector<string>*>& runs, const string& filePath, ESortType sortType,
+                        unsigned int writerCount, EIoMode ioMode) {
+#if !defined(_WIN32)
+    if (ioMode == EIoMode::Direct) return false;
+
+    uint64_t totalBytes = 0;
+    const vector<string>* largest = nullptr;
+    for (const auto * run : runs) {
+        for (const auto & line : *run) totalBytes += line.size() + 1;
+        if (!largest || run->size() > largest->size()) largest = run;
+    }
+    size_t partitionCount = size_t(max<uint64_t>(1, min<uint64_t>(max(1u, writerCount), totalBytes / kMinWritePartitionBytes)));
+
+    // cuts[p][r] is where partition p starts in run r. The last row holds the ends of the runs.
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    vector<vector<size_t>> cuts(partitionCount + 1, vector<size_t>(runs.size(), 0));
+    for (size_t p = 1; p < partitionCount; ++p) {
+        const string& splitter = (*largest)[largest->size() * p / partitionCount];
+        for (size_t r = 0; r < runs.size(); ++r) {
+            auto first = partition_point(runs[r]->begin(), runs[r]->end(),
+                                         [&](const string& line) { return SortsBefore(stringComparer.get(), line, splitter); });
+            cuts[p][r] = size_t(first - runs[r]->begin());
+        }
+    }
+    for (size_t r = 0; r < runs.size(); ++r) cuts[partitionCount][r] = runs[r]->size();
+
+    auto forEachPartition = [partitionCount](const function<void(size_t)>& work) {
+        vector<future<void>> workers;
+        for (size_t p = 0; p < partitionCount; ++p) workers.push_back(async(launch::async, work, p));
+        for (auto& worker : workers) worker.get();
+    };
+
+    vector<uint64_t> startOffset(partitionCount + 1, 0);
+    forEachPartition([&](size_t p) {
+        uint64_t bytes = 0;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            for (size_t i = cuts[p][r]; i < cuts[p + 1][r]; ++i) bytes += (*runs[r])[i].size() + 1;
+        }
+        startOffset[p + 1] = bytes;
+    });
+    for (size_t p = 0; p < partitionCount; ++p) startOffset[p + 1] += startOffset[p];
+
+    // Replace rather than truncate, the old file may be a hard link into the result cache.
+    error_code ec;
+    fs::remove(filePath, ec);
+    WritableMapping output;
+    if (!output.Create(filePath, size_t(totalBytes))) return false;
+
+    forEachPartition([&](size_t p) {
+        unique_ptr<IStringComparer> comparer = MakeComparer(sortType);
+        char* cursor = output.Data() + startOffset[p];
+        auto emit = [&cursor](const string& line) {
+            memcpy(cursor, line.data(), line.size());
+            cursor += line.size();
+            *cursor++ = '\n';
+        };
+
+        // Heap of the runs still holding lines in this partition, smallest head on top.
+        vector<size_t> position(cuts[p]);
+        auto headIsAfter = [&](size_t a, size_t b) {
+            return SortsBefore(comparer.get(), (*runs[b])[position[b]], (*runs[a])[position[a]]);
+        };
+        vector<size_t> heap;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            if (position[r] < cuts[p + 1][r]) heap.push_back(r);
+        }
+        make_heap(heap.begin(), heap.end(), headIsAfter);
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), headIsAfter);
+            size_t r = heap.back();
+            emit((*runs[r])[position[r]++]);
+            if (position[r] < cuts[p + 1][r]) push_heap(heap.begin(), heap.end(), headIsAfter);
+            else heap.pop_back();
+        }
+    });
+
+    if (!output.Close(ioMode)) {
+        cerr << "ERROR: write failed: " << filePath << endl;
+    }
+    return true;
+#else
+    (void)runs; (void)filePath; (void)sortType; (void)writerCount; (void)ioMode;
+    return false;
+#endif
+}
+
+////// Sharded Output
+// A sharded output "<name>.<ext>" is written as "<name>.000.<ext>", "<name>.001.<ext>", ... and a manifest
+// "<name>.shards": "v1 sort <n> shards <k>" then one "<count>\t<first>\t<last>\t<path>" line per shard.
+// Equal lines never straddle two shards, so the key ranges are disjoint and each shard can be used alone.
+// Compressed outputs keep their whole extension: "<name>.000.txt.gz".
+
+// Splits a path's file name into name and extension, counting ".txt.gz" and ".txt.zst" as one extension.
+static pair<string, string> SplitShardName(const fs::path& path) {
+    fs::path stem = path.stem();
+    string extension = path.extension().string();
+    if ((extension == ".gz" || extension == ".zst") && stem.has_extension()) {
+        extension = stem.extension().string() + extension;
+        stem = stem.stem();
+    }
+    return { stem.string(), extension };
+}
+
+string ShardPathFor(const string& filePath, size_t shardIndex) {
+    fs::path path(filePath);
+    auto [name, extension] = SplitShardName(path);
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%03zu", shardIndex);
+    return (path.parent_path() / (name + suffix + extension)).string();
+}
+
+// First line of every shard, followed by lines.size().
+static vector<size_t> PlanShards(const vector<string>& lines, ESortType sortType, const SortOptions& options) {
+    vector<size_t> starts{ 0 };
+    if (options.shardMethod == EShardMethod::Letter) {
+        // LastLetter outputs are ordered by their final character, so that is the one that leads.
+        auto leadingLetter = [sortType](const string& line) {
+            if (line.empty()) return '\0';
+            return sortType == ESortType::LastLetterAsc ? line.back() : line.front();
+        };
+        for (size_t i = 1; i < lines.size(); ++i) {
+            if (leadingLetter(lines[i]) != leadingLetter(lines[i - 1])) starts.push_back(i);
+        }
+    } else {
+        uint64_t totalBytes = 0;
+        for (const auto & line : lines) totalBytes += line.size() + 1;
+        uint64_t shardCount = max(1u, options.shardCount);
+        uint64_t offset = 0;
+        for (size_t i = 0; i + 1 < lines.size() && starts.size() < shardCount; ++i) {
+            offset += lines[i].size() + 1;
+            if (offset >= totalBytes / shardCount * starts.size() && lines[i + 1] != lines[i]) starts.push_back(i + 1);
+        }
+    }
+    starts.push_back(lines.size());
+    return starts;
+}
+
+// Each shard is written by its own thread in the job's format. Compressed shards share one pool.
+void WriteShardedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, const SortOptions& options) {
+    vector<size_t> starts = PlanShards(lines, sortType, options);
+    if (lines.empty()) starts = { 0, 0 };
+    size_t shardCount = starts.size() - 1;
+    unique_ptr<WorkerPool> compressors;
+    if (options.format == EOutputFormat::Text && options.compression != ECompression::None) {
+        compressors = make_unique<WorkerPool>(max(1u, thread::hardware_concurrency()));
+    }
+
+    vector<future<void>> writers;
+    for (size_t shard = 0; shard < shardCount; ++shard) {
+        writers.push_back(async(launch::async, [&, shard]() {
+            string shardPath = ShardPathFor(filePath, shard);
+            size_t from = starts[shard], to = starts[shard + 1];
+            if (options.format == EOutputFormat::Text) {
+                if (options.compression != ECompression::None) WriteCompressedLines(lines, from, to, shardPath, options, compressors.get());
+                else WriteLines(lines, from, to, shardPath, options.ioMode);
+                return;
+            }
+            // The binary formats index a whole list, so they get a copy of the shard's slice.
+            vector<string> slice(lines.begin() + from, lines.begin() + to);
+            if (options.format == EOutputFormat::Indexed) WriteIndexedOutput(slice, shardPath, sortType, options.ioMode);
+            else WriteFrontCodedOutput(slice, shardPath, sortType, options.ioMode);
+        }));
+    }
+    for (auto& writer : writers) writer.get();
+
+    // Shards left over from an earlier run with more of them would otherwise look current.
+    error_code ec;
+    for (size_t shard = shardCount; fs::exists(ShardPathFor(filePath, shard), ec); ++shard) {
+        fs::remove(ShardPathFor(filePath, shard), ec);
+    }
+
+    // The manifest goes last and by rename, so a reader never finds one naming shards not yet written.
+    string manifestPath = (fs::path(filePath).parent_path() / (SplitShardName(filePath).first + ".shards")).string();
+    ofstream manifestOut(manifestPath + ".tmp", ofstream::trunc);
+    manifestOut << "v1 sort " << int(sortType) << " shards " << shardCount << '\n';
+    for (size_t shard = 0; shard < shardCount; ++shard) {
+        size_t from = starts[shard], to = starts[shard + 1];
+        manifestOut << (to - from) << '\t' << (from < to ? lines[from] : string()) << '\t'
+                    << (from < to ? lines[to - 1] : string()) << '\t' << ShardPathFor(filePath, shard) << '\n';
+    }
+    manifestOut.close();
+    fs::rename(manifestPath + ".tmp", manifestPath, ec);
+}
+
+////// Compressed Output
+// Gzip output is BGZF: gzip members of at most kBgzfBlockInput input bytes, each carrying its own size in a
+// "BC" extra field, ending with an empty member. Any gzip reader takes it, and readers that know the field,
+// this one included, can decode the members in parallel. Zstd output is one frame per chunk.
+static const size_t kBgzfBlockInput = 0xFF00;
+static const size_t kGzipChunkBytes = 1024 * 1024;
+static const size_t kZstdChunkBytes = 4 * 1024 * 1024;
+
+// The empty BGZF member that marks a complete file.
+static const unsigned char kBgzfEndOfFile[28] = {
+    0x1F, 0x8B, 0x08, 0x04, 0, 0, 0, 0, 0, 0xFF, 0x06, 0, 'B', 'C', 0x02, 0, 0x1B, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+#if defined(ZLIB_AVAILABLE)
+static void AppendUint16(string& out, uint32_t value) {
+    out.push_back(char(value & 0xFF));
+    out.push_back(char(value >> 8 & 0xFF));
+}
+
+static void AppendUint32(string& out, uint32_t value) {
+    AppendUint16(out, value & 0xFFFF);
+    AppendUint16(out, value >> 16);
+}
+#endif
+
+// Compresses one chunk into independent frames. Called on worker threads.
+string CompressFrames(const char* data, size_t size, ECompression compression, int level) {
+    string out;
+    switch (compression) {
+#if defined(ZLIB_AVAILABLE)
+        case ECompression::Gzip: {
+            z_stream stream{};
+            if (deflateInit2(&stream, level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw runtime_error("deflateInit2 failed");
+            }
+            string deflated;
+            for (size_t offset = 0; offset < size; offset += kBgzfBlockInput) {
+                size_t blockInput = min(kBgzfBlockInput, size - offset);
+                deflated.resize(deflateBound(&stream, uLong(blockInput)));
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + offset));
+                stream.avail_in = uInt(blockInput);
+                stream.next_out = reinterpret_cast<Bytef*>(deflated.data());
+                stream.avail_out = uInt(deflated.size());
+                if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+                    deflateEnd(&stream);
+                    throw runtime_error("deflate failed");
+                }
+                size_t deflatedSize = deflated.size() - stream.avail_out;
+                deflateReset(&stream);
+                // BSIZE is 16 bits. kBgzfBlockInput leaves room for stored blocks, so this only trips on a bad cap.
+                if (18 + deflatedSize + 8 > 65536) {
+                    deflateEnd(&stream);
+                    throw runtime_error("BGZF block of " + to_string(18 + deflatedSize + 8) + " bytes exceeds 65536");
+                }
+
+                // Header with the BC field, the deflated data, then CRC32 and input size.
+                out.append("\x1F\x8B\x08\x04\0\0\0\0\0\xFF", 10);
+                AppendUint16(out, 6);
+                out.append("BC", 2);
+                AppendUint16(out, 2);
+                AppendUint16(out, uint32_t(18 + deflatedSize + 8 - 1));
+                out.append(deflated, 0, deflatedSize);
+                AppendUint32(out, uint32_t(crc32(0, reinterpret_cast<const Bytef*>(data + offset), uInt(blockInput))));
+                AppendUint32(out, uint32_t(blockInput));
+            }
+            deflateEnd(&stream);
+            return out;
+        }
+#endif
+#if defined(ZSTD_AVAILABLE)
+        case ECompression::Zstd: {
+            out.resize(ZSTD_compressBound(size));
+            size_t result = ZSTD_compress(out.data(), out.size(), data, size, level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+            if (ZSTD_isError(result)) throw runtime_error(string("zstd: ") + ZSTD_getErrorName(result));
+            out.resize(result);
+            return out;
+        }
+#endif
+        default:
+            (void)data; (void)size; (void)level;
+            throw runtime_error("compression not available in this build");
+    }
+}
+
+CompressedSink::CompressedSink(const string& path, ECompression codec, int level, EIoMode ioMode)
+    : sink(path, ioMode), compression(codec), compressionLevel(level),
+      ownedPool(make_unique<WorkerPool>(max(1u, thread::hardware_concurrency()))), pool(*ownedPool) {
+    chunk.reserve(compression == ECompression::Zstd ? kZstdChunkBytes : kGzipChunkBytes);
+}
+
+CompressedSink::CompressedSink(const string& path, ECompression codec, int level, EIoMode ioMode, WorkerPool& sharedPool)
+    : sink(path, ioMode), compression(codec), compressionLevel(level), pool(sharedPool) {
+    chunk.reserve(compression == ECompression::Zstd ? kZstdChunkBytes : kGzipChunkBytes);
+}
+
+CompressedSink::~CompressedSink() {
+    Close();
+}
+
+void CompressedSink::Write(const char* data, size_t size) {
+    size_t chunkBytes = compression == ECompression::Zstd ? kZstdChunkBytes : kGzipChunkBytes;
+    while (size > 0) {
+        size_t step = min(size, chunkBytes - chunk.size());
+        chunk.append(data, step);
+        data += step;
+        size -= step;
+        if (chunk.size() == chunkBytes) SubmitChunk();
+    }
+}
+
+void CompressedSink::SubmitChunk() {
+    if (chunk.empty()) return;
+    auto text = make_shared<string>(std::move(chunk));
+    auto frames = make_shared<string>();
+    ECompression codec = compression;
+    int level = compressionLevel;
+    future<void> done = pool.Submit([text, frames, codec, level]() {
+        *frames = CompressFrames(text->data(), text->size(), codec, level);
+    });
+    inFlight.emplace_back(std::move(done), frames);
+    chunk = string();
+    chunk.reserve(text->capacity());
+
+    // Two chunks per thread keep every thread busy without holding the whole output in memory.
+    WriteFinished(size_t(pool.Size()) * 2);
+}
+
+// Writes finished frames in order until at most keepInFlight chunks remain outstanding.
+void CompressedSink::WriteFinished(size_t keepInFlight) {
+    while (inFlight.size() > keepInFlight) {
+        inFlight.front().first.get();
+        sink.Write(*inFlight.front().second);
+        inFlight.pop_front();
+    }
+}
+
+bool CompressedSink::Close() {
+    if (closed) return true;
+    closed = true;
+    bool succeeded = true;
+    try {
+        SubmitChunk();
+        WriteFinished(0);
+        if (compression == ECompression::Gzip) {
+            sink.Write(reinterpret_cast<const char*>(kBgzfEndOfFile), sizeof(kBgzfEndOfFile));
+        }
+    } catch (const exception& e) {
+        cerr << "ERROR: compression failed: " << e.what() << endl;
+        succeeded = false;
+    }
+    return sink.Close() && succeeded;
+}
+
+void WriteCompressedLines(const vector<string>& lines, size_t from, size_t to, const string& filePath, const SortOptions& options,
+                          WorkerPool* sharedPool) {
+    // Replace rather than truncate, the old file may be a hard link into the result cache.
+    error_code ec;
+    fs::remove(filePath, ec);
+
+    optional<CompressedSink> fileOut;
+    if (sharedPool) fileOut.emplace(filePath, options.compression, options.compressionLevel, options.ioMode, *sharedPool);
+    else fileOut.emplace(filePath, options.compression, options.compressionLevel, options.ioMode);
+    for (size_t i = from; i < to; ++i) {
+        fileOut->Write(lines[i]);
+        fileOut->Write("\n", 1);
+    }
+    fileOut->Close();
+}
+
+// Reads back lines this program wrote, without the validation ReadFile applies to inputs.
+vector<string> ReadLines(const string& fileName) {
+    vector<string> lines;
+    ifstream fileIn(fileName);
+    string line;
+    while (getline(fileIn, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// Batch jobs finish concurrently, so keep each report in one piece.
+void PrintTime(const string& outputName, int clockCounter) {
+    static mutex printMutex;
+    lock_guard<mutex> lock(printMutex);
+    cout << endl << outputName << "\t- Time Taken (clocks): " << clockCounter << endl;
+}
+
+// Bare names go to the output directory as .txt, anything with a path separator is used as given.
+string OutputPathFor(const string& outputName, const SortOptions& options) {
+    if (outputName.find('/') != string::npos || outputName.find('\\') != string::npos) {
+        return outputName;
+    }
+    switch (options.format) {
+        case EOutputFormat::Indexed:
+            return options.outputDirectory + outputName + ".idx";
+        case EOutputFormat::FrontCoded:
+            return options.outputDirectory + outputName + ".fc";
+        default:
+            if (options.compression == ECompression::Gzip) return options.outputDirectory + outputName + ".txt.gz";
+            if (options.compression == ECompression::Zstd) return options.outputDirectory + outputName + ".txt.zst";
+            return options.outputDirectory + outputName + ".txt";
+    }
+}
+
+// Every option that changes the bytes of an output must appear here, it is part of the result cache key.
+string DescribeOutputOptions(const SortOptions& options) {
+    string description;
+    switch (options.format) {
+        case EOutputFormat::Indexed:
+            description = "indexed";
+            break;
+        case EOutputFormat::FrontCoded:
+            description = "frontcoded";
+            break;
+        default:
+            description = "text";
+            break;
+    }
+    if (options.compression != ECompression::None) {
+        description += options.compression == ECompression::Gzip ? "|gzip" : "|zstd";
+        description += "|level=" + to_string(options.compressionLevel);
+    }
+    if (options.shardMethod == EShardMethod::Range) description += "|shards=" + to_string(options.shardCount);
+    else if (options.shardMethod == EShardMethod::Letter) description += "|shards=letter";
+    return description;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Batch Jobs
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int RunCommand(const vector<string>& args) {
+    if (args[0] == "--manifest" && args.size() == 2) {
+        return RunManifest(args[1]);
+    }
+
+    if (args[0] == "--pipeline") {
+        SortJob job;
+        string error;
+        if (!ParseJobTokens(vector<string>(args.begin() + 1, args.end()), job, error)) {
+            cerr << "ERROR: " << error << endl;
+            return 1;
+        }
+        return RunCoroutinePipeline(job);
+    }
+
+    if (args[0] == "--scan") {
+        SortJob job;
+        ScanOptions scan;
+        string error;
+        if (!ParseScanTokens(vector<string>(args.begin() + 1, args.end()), job, scan, error)) {
+            cerr << "ERROR: " << error << endl;
+            return 1;
+        }
+        return RunScan(job, scan);
+    }
+
+    if (args[0] == "--incremental") {
+        SortJob job;
+        string error;
+        if (!ParseJobTokens(vector<string>(args.begin() + 1, args.end()), job, error)) {
+            cerr << "ERROR: " << error << endl;
+            return 1;
+        }
+        string unsupported = UnsupportedSpillOption(job.options, false);
+        if (!unsupported.empty()) {
+            cerr << "ERROR: " << unsupported << " is not supported with --incremental" << endl;
+            return 1;
+        }
+        return IncrementalUpdate(job) ? 0 : 1;
+    }
+
+    if (args[0] == "--lookup" && args.size() >= 3) {
+        IndexedOutputReader indexedReader;
+        FrontCodedReader frontCodedReader;
+        bool isIndexed = indexedReader.Open(args[1]);
+        if (!isIndexed && !frontCodedReader.Open(args[1])) {
+            cerr << "ERROR: not an indexed or front-coded output: " << args[1] << endl;
+            return 1;
+        }
+        bool allFound = true;
+        for (size_t i = 2; i < args.size(); ++i) {
+            bool found = isIndexed ? indexedReader.Contains(args[i]) : frontCodedReader.Contains(args[i]);
+            cout << args[i] << (found ? "\tfound" : "\tmissing") << endl;
+            allFound &= found;
+        }
+        return allFound ? 0 : 2;
+    }
+
+    if (args[0] == "--decode" && args.size() == 2) {
+        FrontCodedReader reader;
+        if (!reader.Open(args[1])) {
+            cerr << "ERROR: not a front-coded output: " << args[1] << endl;
+            return 1;
+        }
+        reader.ForEach([](const string& line) { cout << line << '\n'; });
+        return 0;
+    }
+
+    if (args[0] == "--query") {
+        return RunQuery(vector<string>(args.begin() + 1, args.end()));
+    }
+
+    if (args[0] == "--setop") {
+        return RunSetOperation(vector<string>(args.begin() + 1, args.end()));
+    }
+
+    if (args[0] == "--watch") {
+        vector<SortJob> jobs;
+        if (args.size() == 3 && args[1] == "--manifest") {
+            RunnerSettings settings;
+            if (!LoadManifest(args[2], jobs, settings)) return 1;
+        } else {
+            SortJob job;
+            string error;
+            if (!ParseJobTokens(vector<string>(args.begin() + 1, args.end()), job, error)) {
+                cerr << "ERROR: " << error << endl;
+                return 1;
+            }
+            string unsupported = UnsupportedSpillOption(job.options, false);
+            if (!unsupported.empty()) {
+                cerr << "ERROR: " << unsupported << " is not supported with --watch" << endl;
+                return 1;
+            }
+            jobs.push_back(job);
+        }
+        return RunWatch(jobs);
+    }
+
+    cerr << "Usage: TextFileSorter --manifest <file>" << endl;
+    cerr << "       TextFileSorter --pipeline <SortType> <output> <glob>[,<glob>...] [key=value ...]" << endl;
+    cerr << "                      [spill=<dir> [checkpoint=on]]  checkpoint resumes reading and run-sorting, not the final merge" << endl;
+    cerr << "       TextFileSorter --scan <SortType> <output> <root>[,<root>...] [include=<glob>] [exclude=<glob>]" << endl;
+    cerr << "                      [minsize=<bytes>] [maxsize=<bytes>] [symlinks=skip|files|follow] [key=value ...]" << endl;
+    cerr << "       TextFileSorter --incremental <SortType> <output> <glob>[,<glob>...] [key=value ...]" << endl;
+    cerr << "       TextFileSorter --lookup <file.idx|file.fc> <string>..." << endl;
+    cerr << "       TextFileSorter --decode <file.fc>" << endl;
+    cerr << "       TextFileSorter --query <output> (exact <s> | prefix <p> | suffix <s> | range <low> <high>) [sort=<SortType>]" << endl;
+    cerr << "       TextFileSorter --setop (intersect | union | diff) <SortType> <output> <input> <input>... [key=value ...]" << endl;
+    cerr << "       TextFileSorter --watch (--manifest <file> | <SortType> <output> <glob>[,<glob>...] [key=value ...])" << endl;
+    return 1;
+}
+
+// <SortType> <output> <glob>[,<glob>...] [key=value ...]
+bool ParseJobTokens(const vector<string>& tokens, SortJob& job, string& error) {
+    if (tokens.size() < 3 || !ParseSortType(tokens[0], job.sortType)) {
+        error = "expected <SortType> <output> <inputs>";
+        return false;
+    }
+    job.outputName = tokens[1];
+
+    stringstream patternList(tokens[2]);
+    string pattern;
+    while (getline(patternList, pattern, ',')) {
+        if (!pattern.empty()) job.inputPatterns.push_back(pattern);
+    }
+
+    for (size_t i = 3; i < tokens.size(); ++i) {
+        size_t eq = tokens[i].find('=');
+        if (eq == string::npos || !ApplyOption(job.options, tokens[i].substr(0, eq), tokens[i].substr(eq + 1))) {
+            error = "unknown option '" + tokens[i] + "'";
+            return false;
+        }
+    }
+    // The binary formats are searched through a mapping, which compression would rule out.
+    if (job.options.compression != ECompression::None && job.options.format != EOutputFormat::Text) {
+        error = "compress= needs format=text";
+        return false;
+    }
+    if (job.options.checkpoint && job.options.spillDirectory.empty()) {
+        error = "checkpoint=on needs spill=<dir>";
+        return false;
+    }
+    return true;
+}
+
+// Only modes that sort through a RunSpiller act on spill=, spillrun=, checkpoint= and memory=. Returns the
+// first of them set in options that a mode does not support, allowSpill letting spill= and spillrun= through.
+string UnsupportedSpillOption(const SortOptions& options, bool allowSpill) {
+    SortOptions defaults;
+    if (!allowSpill && !options.spillDirectory.empty()) return "spill=";
+    if (!allowSpill && options.spillRunBytes != defaults.spillRunBytes) return "spillrun=";
+    if (options.checkpoint) return "checkpoint=";
+    if (options.memoryLimitBytes != defaults.memoryLimitBytes) return "memory=";
+    return string();
+}
+
+bool ParseIoMode(const string& text, EIoMode& ioModeOut) {
+    if (text == "default") ioModeOut = EIoMode::Default;
+    else if (text == "dontneed") ioModeOut = EIoMode::DontNeed;
+    else if (text == "direct") ioModeOut = EIoMode::Direct;
+    else return false;
+    return true;
+}
+
+bool ParseSortType(const string& text, ESortType& sortTypeOut) {
+    if (text == "AlphAsc") sortTypeOut = ESortType::AlphAsc;
+    else if (text == "AlphDesc") sortTypeOut = ESortType::AlphDesc;
+    else if (text == "LastLetterAsc") sortTypeOut = ESortType::LastLetterAsc;
+    else return false;
+    return true;
+}
+
+bool ApplyOption(SortOptions& options, const string& key, const string& value) {
+    if (key == "outdir") {
+        options.outputDirectory = value;
+        if (!options.outputDirectory.empty() && options.outputDirectory.back() != '/') {
+            options.outputDirectory += '/';
+        }
+        return true;
+    }
+    if (key == "io") {
+        return ParseIoMode(value, options.ioMode);
+    }
+    if (key == "writer") {
+        if (value == "stream") options.writeMethod = EWriteMethod::Stream;
+        else if (value == "pwrite") options.writeMethod = EWriteMethod::Pwrite;
+        else if (value == "mmap") options.writeMethod = EWriteMethod::Mapped;
+        else return false;
+        return true;
+    }
+    if (key == "writers") {
+        // Only the work split changes, the bytes written are the same for any count.
+        try {
+            options.writerThreads = max(1, stoi(value));
+        } catch (const exception&) {
+            return false;
+        }
+        return true;
+    }
+    if (key == "compress") {
+        // Only codecs this build was linked with are accepted.
+        if (value == "none") options.compression = ECompression::None;
+#if defined(ZLIB_AVAILABLE)
+        else if (value == "gzip") options.compression = ECompression::Gzip;
+#endif
+#if defined(ZSTD_AVAILABLE)
+        else if (value == "zstd") options.compression = ECompression::Zstd;
+#endif
+        else return false;
+        return true;
+    }
+    if (key == "compresslevel") {
+        try {
+            options.compressionLevel = stoi(value);
+        } catch (const exception&) {
+            return false;
+        }
+        return true;
+    }
+    if (key == "spill") {
+        options.spillDirectory = value;
+        return true;
+    }
+    if (key == "memory") {
+        try {
+            options.memoryLimitBytes = stoull(value) * 1024 * 1024;
+        } catch (const exception&) {
+            return false;
+        }
+        return true;
+    }
+    if (key == "checkpoint") {
+        if (value == "on") options.checkpoint = true;
+        else if (value == "off") options.checkpoint = false;
+        else return false;
+        return true;
+    }
+    if (key == "spillrun") {
+        try {
+            options.spillRunBytes = max<size_t>(1, stoull(value)) * 1024 * 1024;
+        } catch (const exception&) {
+            return false;
+        }
+        return true;
+    }
+    if (key == "shards") {
+        try {
+            options.shardCount = max(1, stoi(value));
+        } catch (const exception&) {
+            return false;
+        }
+        if (options.shardMethod != EShardMethod::Letter) {
+            options.shardMethod = options.shardCount > 1 ? EShardMethod::Range : EShardMethod::None;
+        }
+        return true;
+    }
+    if (key == "shardby") {
+        if (value == "range") options.shardMethod = options.shardCount > 1 ? EShardMethod::Range : EShardMethod::None;
+        else if (value == "letter") options.shardMethod = EShardMethod::Letter;
+        else return false;
+        return true;
+    }
+    if (key == "format") {
+        if (value == "text") options.format = EOutputFormat::Text;
+        else if (value == "indexed") options.format = EOutputFormat::Indexed;
+        else if (value == "frontcoded") options.format = EOutputFormat::FrontCoded;
+        else return false;
+        return true;
+    }
+    return false;
+}
+
+// Supports '*' (any run of characters) and '?' (any single character).
+bool MatchesWildcard(const string& text, const string& pattern) {
+    size_t t = 0, p = 0, starP = string::npos, starT = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+            ++t; ++p;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starT = t;
+        } else if (starP != string::npos) {
+            // Let the last star swallow one more character and retry.
+            p = starP + 1;
+            t = ++starT;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
+
+// Wildcards are allowed in the file name part only, e.g. ../InputText/*.txt
+vector<string> ExpandInputPattern(const string& pattern) {
+    vector<string> matches;
+    fs::path patternPath(pattern);
+    string namePattern = patternPath.filename().string();
+
+    if (namePattern.find_first_of("*?") == string::npos) {
+        matches.push_back(pattern);
+        return matches;
+    }
+
+    fs::path directory = patternPath.has_parent_path() ? patternPath.parent_path() : fs::path(".");
+    error_code ec;
+    for (const auto & entry : fs::directory_iterator(directory, ec)) {
+        if (!fs::is_directory(entry) && MatchesWildcard(entry.path().filename().string(), namePattern)) {
+            matches.push_back(entry.path().string());
+        }
+    }
+    if (ec) {
+        cerr << "ERROR: unable to list " << directory.string() << ": " << ec.message() << endl;
+    }
+
+    // Directory order is unspecified, keep job inputs stable between runs.
+    sort(matches.begin(), matches.end());
+    return matches;
+}
+
+vector<string> ExpandJobInputs(const SortJob& job) {
+    vector<string> inputFiles;
+    for (const auto & pattern : job.inputPatterns) {
+        vector<string> expanded = ExpandInputPattern(pattern);
+        inputFiles.insert(inputFiles.end(), expanded.begin(), expanded.end());
+    }
+    return inputFiles;
+}
+
+////// Recursive Input Discovery
+static bool MatchesAnyPattern(const string& relativePath, const string& fileName, const vector<string>& patterns) {
+    for (const auto & pattern : patterns) {
+        const string& text = pattern.find('/') != string::npos ? relativePath : fileName;
+        if (MatchesWildcard(text, pattern)) return true;
+    }
+    return false;
+}
+
+// Walks every root recursively on threadCount threads. Each thread lists one directory at a time and puts
+// the subdirectories it finds back on the shared list. onFile is called from the walking threads as soon as
+// a file passes the filters, so it must be thread safe.
+void EnumerateInputs(const vector<string>& roots, const ScanOptions& scan, unsigned int threadCount,
+                     const function<void(InputFile&&)>& onFile) {
+    mutex walkMutex;
+    condition_variable walkSignal;
+    deque<pair<fs::path, fs::path>> directories;
+    size_t busyWalkers = 0;
+    unordered_set<string> visited;
+
+    auto acceptFile = [&scan, &onFile](const fs::path& path, const string& relativePath, uintmax_t size) {
+        if (size < scan.minSize || size > scan.maxSize) return;
+        string fileName = path.filename().string();
+        if (!scan.includePatterns.empty() && !MatchesAnyPattern(relativePath, fileName, scan.includePatterns)) return;
+        if (MatchesAnyPattern(relativePath, fileName, scan.excludePatterns)) return;
+        onFile({ path.string(), size });
+    };
+
+    // With links followed a directory can be reached twice, or from inside itself, so each real one is
+    // recorded. Only called with walkMutex held.
+    auto firstVisit = [&scan, &visited](const fs::path& directory) {
+        if (scan.symlinks != ESymlinkPolicy::Follow) return true;
+        error_code ec;
+        fs::path real = fs::canonical(directory, ec);
+        return ec ? false : visited.insert(real.string()).second;
+    };
+
+    for (const auto & root : roots) {
+        error_code ec;
+        if (fs::is_directory(root, ec)) {
+            if (firstVisit(root)) directories.emplace_back(root, root);
+        } else if (fs::is_regular_file(root, ec)) {
+            uintmax_t size = fs::file_size(root, ec);
+            if (!ec) acceptFile(root, fs::path(root).filename().string(), size);
+        } else {
+            cerr << "ERROR: input root not found: " << root << endl;
+        }
+    }
+
+    auto walk = [&]() {
+        while (true) {
+            pair<fs::path, fs::path> current;
+            {
+                unique_lock<mutex> lock(walkMutex);
+                walkSignal.wait(lock, [&]() { return !directories.empty() || busyWalkers == 0; });
+                if (directories.empty()) return;
+                current = std::move(directories.front());
+                directories.pop_front();
+                ++busyWalkers;
+            }
+            const fs::path& directory = current.first;
+            const fs::path& root = current.second;
+
+            vector<fs::path> subdirectories;
+            error_code ec;
+            for (fs::directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec), end;
+                 !ec && it != end; it.increment(ec)) {
+                const fs::directory_entry& entry = *it;
+                error_code statEc;
+                bool isLink = entry.is_symlink(statEc);
+                if (isLink && scan.symlinks == ESymlinkPolicy::Skip) continue;
+
+                string relativePath = entry.path().lexically_relative(root).generic_string();
+                if (entry.is_directory(statEc)) {
+                    if (isLink && scan.symlinks != ESymlinkPolicy::Follow) continue;
+                    if (MatchesAnyPattern(relativePath, entry.path().filename().string(), scan.excludePatterns)) continue;
+                    subdirectories.push_back(entry.path());
+                } else if (entry.is_regular_file(statEc)) {
+                    uintmax_t size = entry.file_size(statEc);
+                    if (!statEc) acceptFile(entry.path(), relativePath, size);
+                }
+            }
+            if (ec) {
+                cerr << "ERROR: unable to list directory: " << directory.string() << endl;
+            }
+
+            {
+                lock_guard<mutex> lock(walkMutex);
+                for (auto& subdirectory : subdirectories) {
+                    if (firstVisit(subdirectory)) directories.emplace_back(std::move(subdirectory), root);
+                }
+                --busyWalkers;
+            }
+            walkSignal.notify_all();
+        }
+    };
+
+    vector<thread> walkers;
+    for (unsigned int i = 0; i < max(1u, threadCount); ++i) {
+        walkers.emplace_back(walk);
+    }
+    for (auto& walker : walkers) {
+        walker.join();
+    }
+}
+
+// <SortType> <output> <root>[,<root>...] with include=, exclude=, minsize=, maxsize= and symlinks= taken
+// here and any other key=value passed on to the job. include and exclude may be repeated.
+bool ParseScanTokens(const vector<string>& tokens, SortJob& job, ScanOptions& scan, string& error) {
+    vector<string> jobTokens;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        size_t eq = tokens[i].find('=');
+        string key = i < 3 || eq == string::npos ? string() : tokens[i].substr(0, eq);
+        string value = key.empty() ? string() : tokens[i].substr(eq + 1);
+        try {
+            if (key == "include") scan.includePatterns.push_back(value);
+            else if (key == "exclude") scan.excludePatterns.push_back(value);
+            else if (key == "minsize") scan.minSize = stoull(value);
+            else if (key == "maxsize") scan.maxSize = stoull(value);
+            else if (key == "symlinks" && value == "skip") scan.symlinks = ESymlinkPolicy::Skip;
+            else if (key == "symlinks" && value == "files") scan.symlinks = ESymlinkPolicy::Files;
+            else if (key == "symlinks" && value == "follow") scan.symlinks = ESymlinkPolicy::Follow;
+            else jobTokens.push_back(tokens[i]);
+        } catch (const exception&) {
+            error = "bad value in '" + tokens[i] + "'";
+            return false;
+        }
+    }
+    if (!ParseJobTokens(jobTokens, job, error)) return false;
+    // Scans cut large files into ranges and share batches between files, so a run never holds whole inputs.
+    if (job.options.checkpoint) {
+        error = "checkpoint=on is only supported with --pipeline";
+        return false;
+    }
+    return true;
+}
+
+// The walk feeds the read scheduler from its own threads, so reading starts with the first file found
+// instead of after the whole tree has been listed.
+int RunScan(const SortJob& job, const ScanOptions& scan) {
+    clock_t startTime = clock();
+    ReadScheduler scheduler;
+    future<void> walk = async(launch::async, [&job, &scan, &scheduler]() {
+        try {
+            EnumerateInputs(job.inputPatterns, scan, max(2u, thread::hardware_concurrency()),
+                            [&scheduler](InputFile&& file) { scheduler.AddFile(file); });
+        } catch (...) {
+            scheduler.Finish();
+            throw;
+        }
+        scheduler.Finish();
+    });
+
+    string outputPath = OutputPathFor(job.outputName, job.options);
+    unique_ptr<RunSpiller> spiller = MakeSpiller(outputPath, job.sortType, job.options);
+    vector<vector<string>> runs;
+    try {
+        runs = SortScheduledRuns(scheduler, job.sortType, spiller.get());
+    } catch (const exception& e) {
+        cerr << "ERROR: reading failed: " << e.what() << endl;
+        return 1;
+    }
+    try {
+        walk.get();
+    } catch (const exception& e) {
+        cerr << "ERROR: directory walk failed: " << e.what() << endl;
+        return 1;
+    }
+
+    // A spiller that never had to spill hands its runs back for the in-memory merge.
+    if (spiller && spiller->KeepsRunsInMemory()) {
+        runs = spiller->TakeRuns();
+        spiller.reset();
+    }
+    if (!spiller) {
+        MergeWriteAndPrint(std::move(runs), outputPath, startTime, job.sortType, job.options);
+        return 0;
+    }
+    try {
+        MergeSpilledWriteAndPrint(*spiller, outputPath, startTime, job.sortType, job.options);
+    } catch (const exception& e) {
+        cerr << "ERROR: external sort failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Manifest format, one job per line:
+//   <SortType> <output> <glob>[,<glob>...] [key=value ...]
+// Lines starting with "set" configure the runner: threads=N, memory=<MB>, cache=<dir>,
+// results=<dir> and resultsize=<MB> for the result cache, io=<default|dontneed|direct> for input reads.
+// Blank lines and lines starting with '#' are ignored.
+bool LoadManifest(const string& manifestPath, vector<SortJob>& jobs, RunnerSettings& settings) {
+    ifstream manifestIn(manifestPath);
+    if (!manifestIn) {
+        cerr << "ERROR: unable to open manifest: " << manifestPath << endl;
+        return false;
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(manifestIn, line)) {
+        ++lineNumber;
+        istringstream tokens(line);
+        string first;
+        if (!(tokens >> first) || first[0] == '#') continue;
+
+        if (first == "set") {
+            string setting;
+            while (tokens >> setting) {
+                size_t eq = setting.find('=');
+                string key = setting.substr(0, eq);
+                string value = eq == string::npos ? "" : setting.substr(eq + 1);
+                try {
+                    if (key == "threads") settings.threadCount = max(1, stoi(value));
+                    else if (key == "memory") settings.memoryLimitBytes = stoull(value) * 1024 * 1024;
+                    else if (key == "cache") settings.cacheDirectory = value;
+                    else if (key == "results") settings.resultDirectory = value;
+                    else if (key == "resultsize") settings.resultLimitBytes = stoull(value) * 1024 * 1024;
+                    else if (key == "io") {
+                        if (!ParseIoMode(value, settings.inputIoMode)) throw invalid_argument(value);
+                    } else {
+                        cerr << "ERROR: unknown setting '" << key << "' on manifest line " << lineNumber << endl;
+                        return false;
+                    }
+                } catch (const exception&) {
+                    cerr << "ERROR: bad value in '" << setting << "' on manifest line " << lineNumber << endl;
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        vector<string> jobTokens{ first };
+        string token;
+        while (tokens >> token) jobTokens.push_back(token);
+
+        SortJob job;
+        string error;
+        if (!ParseJobTokens(jobTokens, job, error)) {
+            cerr << "ERROR: " << error << " on manifest line " << lineNumber << ": " << line << endl;
+            return false;
+        }
+        // Manifest jobs share the runner's memory budget and sort in memory.
+        string unsupported = UnsupportedSpillOption(job.options, false);
+        if (!unsupported.empty()) {
+            cerr << "ERROR: " << unsupported << " is not supported in manifests, on line " << lineNumber << ": " << line << endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int RunManifest(const string& manifestPath) {
+    vector<SortJob> jobs;
+    RunnerSettings settings;
+    if (!LoadManifest(manifestPath, jobs, settings)) {
+        return 1;
+    }
+
+    WorkerPool pool(settings.threadCount);
+    MemoryBudget budget(settings.memoryLimitBytes);
+    unique_ptr<ParsedFileCache> diskCache;
+    if (!settings.cacheDirectory.empty()) {
+        diskCache = make_unique<ParsedFileCache>(settings.cacheDirectory);
+    }
+    ParsedInputCache inputCache(diskCache.get(), settings.inputIoMode);
+    unique_ptr<ResultCache> resultCache;
+    if (!settings.resultDirectory.empty()) {
+        resultCache = make_unique<ResultCache>(settings.resultDirectory, settings.resultLimitBytes);
+    }
+    vector<future<void>> pending;
+
+    // Every job's inputs are known before the first one runs, so a shared file stays cached exactly as long
+    // as some job still has to read it.
+    vector<vector<string>> jobInputs;
+    for (const auto & job : jobs) {
+        jobInputs.push_back(ExpandJobInputs(job));
+        for (const auto & file : jobInputs.back()) inputCache.AddUse(file);
+    }
+
+    for (size_t jobIndex = 0; jobIndex < jobs.size(); ++jobIndex) {
+        const SortJob& job = jobs[jobIndex];
+        const vector<string>& inputFiles = jobInputs[jobIndex];
+        pending.push_back(pool.Submit([&job, &inputFiles, &budget, &inputCache, &resultCache]() {
+            clock_t startTime = clock();
+            InputUses uses(inputCache, inputFiles);
+
+            // An identical earlier job already produced this output, reuse it without reading anything.
+            // The cache holds single files, so sharded outputs are always rebuilt.
+            string outputPath = OutputPathFor(job.outputName, job.options);
+            string resultKey;
+            bool useResultCache = resultCache && job.options.shardMethod == EShardMethod::None;
+            if (useResultCache) {
+                resultKey = resultCache->KeyFor(inputFiles, job.sortType, job.options);
+                if (resultCache->Fetch(resultKey, outputPath)) {
+                    PrintTime(outputPath + " (cached)", int(clock() - startTime));
+                    return;
+                }
+            }
+
+            // Reserve roughly twice the input size: the lines themselves plus merge scratch.
+            size_t reservedBytes = 0;
+            for (const auto & file : inputFiles) {
+                error_code ec;
+                uintmax_t size = fs::file_size(file, ec);
+                if (!ec) reservedBytes += size_t(size) * 2;
+            }
+            BudgetReservation reservation(budget, reservedBytes);
+
+            vector<string> finalList;
+            for (const auto & file : inputFiles) {
+                shared_ptr<const CachedFileLines> parsed = inputCache.Get(file);
+                finalList.insert(finalList.end(), parsed->lines.begin(), parsed->lines.end());
+            }
+            uses.Release();
+            finalList = MergeSortWrapper(finalList, job.sortType);
+            clock_t endTime = clock();
+
+            WriteAndPrint(finalList, outputPath, endTime - startTime, job.sortType, job.options);
+            if (useResultCache) {
+                resultCache->Store(resultKey, outputPath);
+            }
+        }));
+    }
+
+    int failures = 0;
+    for (auto& p : pending) {
+        try {
+            p.get();
+        } catch (const exception& e) {
+            cerr << "ERROR: job failed: " << e.what() << endl;
+            ++failures;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+
+////// Worker Pool
+WorkerPool::WorkerPool(unsigned int threadCount) {
+    for (unsigned int i = 0; i < threadCount; ++i) {
+        workers.emplace_back([this]() {
+            while (true) {
+                packaged_task<void()> task;
+                {
+                    unique_lock<mutex> lock(queueMutex);
+                    queueSignal.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                    if (stopping && tasks.empty()) return;
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+                task();
+            }
+        });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueSignal.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+future<void> WorkerPool::Submit(function<void()> task) {
+    packaged_task<void()> packaged(std::move(task));
+    future<void> result = packaged.get_future();
+    {
+        lock_guard<mutex> lock(queueMutex);
+        tasks.push(std::move(packaged));
+    }
+    queueSignal.notify_one();
+    return result;
+}
+
+
+////// Memory Budget
+void MemoryBudget::Acquire(size_t bytes) {
+    unique_lock<mutex> lock(budgetMutex);
+    // A single job larger than the whole budget still runs, but only once everything else has drained.
+    budgetSignal.wait(lock, [this, bytes]() { return used == 0 || used + bytes <= limit; });
+    used += bytes;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+    {
+        lock_guard<mutex> lock(budgetMutex);
+        used -= bytes;
+    }
+    budgetSignal.notify_all();
+}
+
+
+////// Memory Governor
+void MemoryGovernor::Charge(EMemoryUse use, size_t bytes) {
+    byUse[size_t(use)].fetch_add(bytes, memory_order_relaxed);
+    used.fetch_add(bytes, memory_order_relaxed);
+}
+
+void MemoryGovernor::Release(EMemoryUse use, size_t bytes) {
+    byUse[size_t(use)].fetch_sub(bytes, memory_order_relaxed);
+    used.fetch_sub(bytes, memory_order_relaxed);
+}
+
+// What a list of lines costs: the characters plus a string object each, ignoring small-string storage.
+size_t LineBytes(const vector<string>& lines) {
+    size_t bytes = 0;
+    for (const auto & line : lines) bytes += line.size() + sizeof(string);
+    return bytes;
+}
+
+
+////// Result Cache
+string ResultCache::KeyFor(const vector<string>& inputFiles, ESortType sortType, const SortOptions& options) const {
+    // File identity is path, size and mtime, in a stable order so glob order does not matter.
+    vector<string> identities;
+    for (const auto & file : inputFiles) {
+        error_code ec;
+        string identity = fs::weakly_canonical(file, ec).string();
+        identity += '|' + to_string(fs::file_size(file, ec));
+        identity += '|' + to_string(fs::last_write_time(file, ec).time_since_epoch().count());
+        identities.push_back(identity);
+    }
+    sort(identities.begin(), identities.end());
+
+    string description = to_string(int(sortType)) + '|' + DescribeOutputOptions(options);
+    for (const auto & identity : identities) {
+        description += '\n' + identity;
+    }
+
+    // Two differently seeded hashes keep accidental collisions out of reach.
+    char key[40];
+    snprintf(key, sizeof(key), "%016llx%016llx",
+             (unsigned long long)HashBytes(description.data(), description.size()),
+             (unsigned long long)HashBytes(description.data(), description.size(), 0x9e3779b97f4a7c15ull));
+    return key;
+}
+
+bool ResultCache::Fetch(const string& key, const string& outputPath) {
+    lock_guard<mutex> lock(cacheMutex);
+    string entryPath = (fs::path(cacheDirectory) / (key + ".out")).string();
+    error_code ec;
+    if (!fs::exists(entryPath, ec)) return false;
+
+    fs::remove(outputPath, ec);
+    if (!LinkOrCopyFile(entryPath, outputPath)) return false;
+
+    // The entry's mtime doubles as its last use for eviction.
+    fs::last_write_time(entryPath, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void ResultCache::Store(const string& key, const string& outputPath) {
+    lock_guard<mutex> lock(cacheMutex);
+    error_code ec;
+    fs::create_directories(cacheDirectory, ec);
+    string entryPath = (fs::path(cacheDirectory) / (key + ".out")).string();
+    fs::remove(entryPath, ec);
+    if (LinkOrCopyFile(outputPath, entryPath)) {
+        fs::last_write_time(entryPath, fs::file_time_type::clock::now(), ec);
+        Evict();
+    }
+}
+
+void ResultCache::Evict() {
+    vector<pair<fs::file_time_type, fs::path>> entries;
+    uintmax_t totalBytes = 0;
+    error_code ec;
+    for (const auto & entry : fs::directory_iterator(cacheDirectory, ec)) {
+        if (entry.path().extension() != ".out") continue;
+        totalBytes += entry.file_size(ec);
+        entries.emplace_back(entry.last_write_time(ec), entry.path());
+    }
+
+    sort(entries.begin(), entries.end());
+    for (const auto & entry : entries) {
+        if (totalBytes <= byteLimit) break;
+        uintmax_t size = fs::file_size(entry.second, ec);
+        if (fs::remove(entry.second, ec)) totalBytes -= size;
+    }
+}
+
+// Hard links make a cache hit free, copying covers file systems without them.
+bool LinkOrCopyFile(const string& from, const string& to) {
+    error_code ec;
+    fs::create_hard_link(from, to, ec);
+    if (!ec) return true;
+    return fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+}
+
+
+////// Parsed Input Cache
+void ParsedInputCache::AddUse(const string& fileName) {
+    error_code ec;
+    string key = fs::weakly_canonical(fileName, ec).string();
+    lock_guard<mutex> lock(cacheMutex);
+    ++entries[key].uses;
+}
+
+// Jobs already holding the lines keep them alive, the cache just stops handing them out.
+void ParsedInputCache::Release(const string& fileName) {
+    error_code ec;
+    string key = fs::weakly_canonical(fileName, ec).string();
+    lock_guard<mutex> lock(cacheMutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) return;
+    if (it->second.uses <= 1) entries.erase(it);
+    else --it->second.uses;
+}
+
+shared_ptr<const CachedFileLines> ParsedInputCache::Get(const string& fileName) {
+    error_code ec;
+    string key = fs::weakly_canonical(fileName, ec).string();
+    promise<shared_ptr<const CachedFileLines>> loader;
+    shared_future<shared_ptr<const CachedFileLines>> entry;
+    bool isLoader = false;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        Entry& cached = entries[key];
+        if (!cached.isLoading) {
+            cached.lines = loader.get_future().share();
+            cached.isLoading = true;
+            isLoader = true;
+        }
+        entry = cached.lines;
+    }
+
+    // The first job to ask reads the file on its own thread, the others wait for that result.
+    if (isLoader) {
+        if (fileCache) {
+            loader.set_value(fileCache->Read(fileName));
+        } else {
+            auto parsed = make_shared<CachedFileLines>();
+            parsed->owned = ReadFileWithMode(fileName, ioMode);
+            parsed->lines.assign(parsed->owned.begin(), parsed->owned.end());
+            loader.set_value(parsed);
+        }
+    }
+    return entry.get();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Incremental Sorting
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Next to every incrementally maintained output lives "<output>.state/", holding:
+//   state.txt        "v3 sort <n>" then one "<size>\t<mtime>\t<consumed>\t<prefix hash>\t<part>\t<path>" line
+//                    per contributing file
+//   <part>.txt       that file's accepted lines, sorted, so they can be taken out again later
+struct TrackedFile {
+    uintmax_t size = 0;
+    int64_t modified = 0;
+    // Bytes already read, and a hash of all of them to recognise appends.
+    uintmax_t consumed = 0;
+    uint64_t prefixHash = 0;
+    string partName;
+};
+
+// Hash of the file's first "end" bytes, read in chunks. Zero if the file is shorter or unreadable.
+static uint64_t HashFilePrefix(const string& fileName, uintmax_t end) {
+    vector<char> chunk(1024 * 1024);
+    ifstream fileIn(fileName, ios::binary);
+    uint64_t hash = HashBytes(nullptr, 0);
+    for (uintmax_t done = 0; done < end; ) {
+        size_t length = size_t(min<uintmax_t>(end - done, chunk.size()));
+        if (!fileIn.read(chunk.data(), streamsize(length))) return 0;
+        hash = HashBytes(chunk.data(), length, hash);
+        done += length;
+    }
+    return hash;
+}
+
+// True when the file still starts with what was consumed last time and that ended on a full line. The
+// whole prefix is hashed, so an edit anywhere before the old end makes it a rewrite. Compressed inputs are never treated as appended to, an offset into them means nothing to the text.
+static bool IsAppendOnly(const string& fileName, const TrackedFile& previous, uintmax_t newSize) {
+    if (previous.consumed == 0 || newSize < previous.consumed) return false;
+    if (DetectFileCompression(fileName) != ECompression::None) return false;
+    char lastByte = 0;
+    ifstream fileIn(fileName, ios::binary);
+    fileIn.seekg(streamoff(previous.consumed - 1));
+    if (!fileIn.get(lastByte) || lastByte != '\n') return false;
+    return HashFilePrefix(fileName, previous.consumed) == previous.prefixHash;
+}
+
+// Validated lines from byte "from" to the end of the file, read in one go so the bytes parsed and the
+// offset recorded agree even while the file grows. Reads past the start stop after the last newline, so a
+// line still being appended is picked up whole next time. consumedOut is where the next read starts, and
+// hashInOut, the hash of the bytes before "from", is carried on over the bytes consumed.
+static vector<string> ReadFileFrom(const string& fileName, uintmax_t from, uintmax_t& consumedOut, uint64_t& hashInOut) {
+    vector<string> lines;
+    consumedOut = from;
+    if (from == 0 && DetectFileCompression(fileName) != ECompression::None) {
+        error_code ec;
+        consumedOut = fs::file_size(fileName, ec);
+        return ReadFile(fileName);
+    }
+    ifstream fileIn(fileName, ios::binary);
+    if (!fileIn) {
+        cout << "Unable to open file, please close input files: " << fileName << endl;
+        return lines;
+    }
+    fileIn.seekg(streamoff(from));
+    string contents((istreambuf_iterator<char>(fileIn)), istreambuf_iterator<char>());
+    size_t usable = contents.size();
+    if (from > 0) {
+        size_t lastNewline = contents.rfind('\n');
+        usable = lastNewline == string::npos ? 0 : lastNewline + 1;
+    }
+    ParseBuffer(contents.data(), usable, fileName, lines, nullptr);
+    consumedOut = from + usable;
+    hashInOut = HashBytes(contents.data(), usable, hashInOut);
+    return lines;
+}
+
+static bool LoadIncrementalState(const string& stateDirectory, ESortType sortType, map<string, TrackedFile>& filesOut) {
+    ifstream stateIn((fs::path(stateDirectory) / "state.txt").string());
+    string line;
+    if (!getline(stateIn, line) || line != "v3 sort " + to_string(int(sortType))) {
+        return false;
+    }
+    // A damaged state file counts as no state at all, which rebuilds the output from scratch. Skipping
+    // just the bad line would lose track of lines already merged into the output.
+    auto toUnsigned = [](const string& text) {
+        size_t used = 0;
+        unsigned long long value = stoull(text, &used);
+        if (used != text.size()) throw invalid_argument(text);
+        return value;
+    };
+    while (getline(stateIn, line)) {
+        istringstream fields(line);
+        string size, modified, consumed, prefixHash, path;
+        TrackedFile tracked;
+        try {
+            if (!getline(fields, size, '\t') || !getline(fields, modified, '\t') || !getline(fields, consumed, '\t') ||
+                !getline(fields, prefixHash, '\t') || !getline(fields, tracked.partName, '\t') || !getline(fields, path)) {
+                throw invalid_argument(line);
+            }
+            size_t used = 0;
+            tracked.modified = stoll(modified, &used);
+            if (used != modified.size()) throw invalid_argument(modified);
+            tracked.size = toUnsigned(size);
+            tracked.consumed = toUnsigned(consumed);
+            tracked.prefixHash = toUnsigned(prefixHash);
+        } catch (const exception&) {
+            filesOut.clear();
+            return false;
+        }
+        filesOut[path] = tracked;
+    }
+    return true;
+}
+
+// Streams the previous output with one occurrence of every removed line dropped and the added lines merged
+// in, all three in sort order, so the result is the only full copy held.
+static void MergeIncrementalOutput(const string& previousPath, const vector<string>& removed, const vector<string>& added,
+                                   IStringComparer* stringComparer, const function<void(const string&)>& emit) {
+    size_t r = 0, a = 0;
+    ifstream previousIn(previousPath);
+    string line;
+    while (!previousPath.empty() && getline(previousIn, line)) {
+        while (r < removed.size() && SortsBefore(stringComparer, removed[r], line)) ++r;
+        if (r < removed.size() && removed[r] == line) {
+            ++r;
+            continue;
+        }
+        // Ties keep the previous line first, as MergeSortedLists does.
+        while (a < added.size() && SortsBefore(stringComparer, added[a], line)) emit(added[a++]);
+        emit(line);
+    }
+    while (a < added.size()) emit(added[a++]);
+}
+
+static void SaveIncrementalState(const string& stateDirectory, ESortType sortType, const map<string, TrackedFile>& files) {
+    string statePath = (fs::path(stateDirectory) / "state.txt").string();
+    ofstream stateOut(statePath + ".tmp", ofstream::trunc);
+    stateOut << "v3 sort " << int(sortType) << '\n';
+    for (const auto & [path, tracked] : files) {
+        stateOut << tracked.size << '\t' << tracked.modified << '\t' << tracked.consumed << '\t' << tracked.prefixHash << '\t'
+                 << tracked.partName << '\t' << path << '\n';
+    }
+    stateOut.close();
+    error_code ec;
+    fs::rename(statePath + ".tmp", statePath, ec);
+}
+
+bool IncrementalUpdate(const SortJob& job) {
+    clock_t startTime = clock();
+    string outputPath = OutputPathFor(job.outputName, job.options);
+    string stateDirectory = outputPath + ".state";
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(job.sortType);
+
+    // The previous result is read back as lines, so only text outputs can be updated in place.
+    if (job.options.format != EOutputFormat::Text || job.options.shardMethod != EShardMethod::None ||
+        job.options.compression != ECompression::None) {
+        cerr << "ERROR: incremental updates need an unsharded, uncompressed format=text output: " << outputPath << endl;
+        return false;
+    }
+
+    // Without a previous output and state for the same sort type, everything counts as new.
+    map<string, TrackedFile> previous;
+    error_code ec;
+    bool havePrevious = fs::exists(outputPath, ec) && LoadIncrementalState(stateDirectory, job.sortType, previous);
+    if (!havePrevious) {
+        fs::remove_all(stateDirectory, ec);
+        previous.clear();
+    }
+    fs::create_directories(stateDirectory, ec);
+
+    // Every changed file contributes one sorted run, merged once at the end rather than file by file.
+    map<string, TrackedFile> current;
+    vector<vector<string>> removedRuns, addedRuns;
+    bool anyChange = !havePrevious;
+    for (const auto & file : ExpandJobInputs(job)) {
+        // A file matched by two patterns is still one input.
+        string path = fs::weakly_canonical(file, ec).string();
+        if (current.count(path)) continue;
+        TrackedFile tracked;
+        tracked.size = fs::file_size(file, ec);
+        tracked.modified = int64_t(fs::last_write_time(file, ec).time_since_epoch().count());
+        if (ec) continue;
+
+        auto it = previous.find(path);
+        if (it != previous.end() && it->second.size == tracked.size && it->second.modified == tracked.modified) {
+            current[path] = it->second;
+            previous.erase(it);
+            continue;
+        }
+
+        anyChange = true;
+        char partName[24];
+        snprintf(partName, sizeof(partName), "%016llx", (unsigned long long)HashBytes(path.data(), path.size()));
+        tracked.partName = partName;
+        string partPath = (fs::path(stateDirectory) / (tracked.partName + ".txt")).string();
+
+        // Grown by appending only: read from the old end of file and add the new lines to the part.
+        if (it != previous.end() && IsAppendOnly(file, it->second, tracked.size)) {
+            tracked.prefixHash = it->second.prefixHash;
+            vector<string> appendedLines =
+                MergeSortWrapper(ReadFileFrom(file, it->second.consumed, tracked.consumed, tracked.prefixHash), job.sortType);
+            WriteLines(MergeSortedLists(ReadLines(partPath), appendedLines, stringComparer.get()), partPath);
+            addedRuns.push_back(std::move(appendedLines));
+            current[path] = tracked;
+            previous.erase(it);
+            continue;
+        }
+
+        // New or rewritten: sort just this file and keep its lines as the provenance record.
+        if (it != previous.end()) {
+            removedRuns.push_back(ReadLines(partPath));
+            previous.erase(it);
+        }
+        tracked.prefixHash = HashBytes(nullptr, 0);
+        vector<string> fileLines = MergeSortWrapper(ReadFileFrom(file, 0, tracked.consumed, tracked.prefixHash), job.sortType);
+        WriteLines(fileLines, partPath);
+        addedRuns.push_back(std::move(fileLines));
+        current[path] = tracked;
+    }
+
+    // Whatever is left in previous has been deleted since the last run.
+    if (!previous.empty()) anyChange = true;
+    if (!anyChange) return true;
+    for (const auto & [path, tracked] : previous) {
+        string partPath = (fs::path(stateDirectory) / (tracked.partName + ".txt")).string();
+        removedRuns.push_back(ReadLines(partPath));
+        fs::remove(partPath, ec);
+    }
+    vector<string> removedLines = MergeRuns(std::move(removedRuns), job.sortType);
+    vector<string> addedLines = MergeRuns(std::move(addedRuns), job.sortType);
+    string previousPath = havePrevious ? outputPath : string();
+
+    // Streamed writes go to a temporary next to the output, which is still being read, and replace it.
+    if (job.options.writeMethod == EWriteMethod::Stream) {
+        string temporary = outputPath + ".tmp";
+        fs::remove(temporary, ec);
+        FileSink fileOut(temporary, job.options.ioMode);
+        MergeIncrementalOutput(previousPath, removedLines, addedLines, stringComparer.get(), [&fileOut](const string& line) {
+            fileOut.Write(line);
+            fileOut.Write("\n", 1);
+        });
+        if (!fileOut.Close()) {
+            cerr << "ERROR: unable to write " << temporary << endl;
+            fs::remove(temporary, ec);
+            return false;
+        }
+        fs::rename(temporary, outputPath, ec);
+        if (ec) {
+            cerr << "ERROR: unable to replace " << outputPath << ": " << ec.message() << endl;
+            return false;
+        }
+        PrintTime(outputPath, int(clock() - startTime));
+    } else {
+        vector<string> finalList;
+        MergeIncrementalOutput(previousPath, removedLines, addedLines, stringComparer.get(),
+                               [&finalList](const string& line) { finalList.push_back(line); });
+        WriteAndPrint(finalList, outputPath, int(clock() - startTime), job.sortType, job.options);
+    }
+    SaveIncrementalState(stateDirectory, job.sortType, current);
+    return true;
+}
+
+
+////// Watch Mode
+static atomic<bool> watchStopRequested(false);
+
+static void RequestWatchStop(int) {
+    watchStopRequested = true;
+}
+
+// Bursts of events (a copy writing in many chunks, a batch of new files) settle for this long before an update.
+static const int kWatchDebounceMs = 500;
+// A file that never goes quiet, such as a log being appended to, still gets an update this often.
+static const int kWatchMaxDelayMs = 5000;
+// Polling interval where inotify is not available.
+static const int kWatchPollMs = 2000;
+
+int RunWatch(const vector<SortJob>& jobs) {
+    signal(SIGINT, RequestWatchStop);
+    signal(SIGTERM, RequestWatchStop);
+
+    // Bring every output up to date before waiting for changes.
+    for (const auto & job : jobs) {
+        IncrementalUpdate(job);
+    }
+
+#if defined(__linux__)
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd >= 0) {
+        // Watch every directory an input pattern points into, and remember which jobs care about it.
+        map<int, string> watchedDirectories;
+        map<string, int> directoryWatches;
+        for (const auto & job : jobs) {
+            for (const auto & pattern : job.inputPatterns) {
+                fs::path patternPath(pattern);
+                string directory = patternPath.has_parent_path() ? patternPath.parent_path().string() : ".";
+                if (directoryWatches.count(directory)) continue;
+                int watch = inotify_add_watch(inotifyFd, directory.c_str(),
+                                              IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+                if (watch < 0) {
+                    cerr << "ERROR: unable to watch " << directory << ": " << strerror(errno) << endl;
+                    continue;
+                }
+                watchedDirectories[watch] = directory;
+                directoryWatches[directory] = watch;
+            }
+        }
+        cout << "Watching " << watchedDirectories.size() << " director" << (watchedDirectories.size() == 1 ? "y" : "ies")
+             << ", Ctrl+C to stop." << endl;
+
+        alignas(inotify_event) char events[16 * 1024];
+        vector<bool> dirty(jobs.size(), false);
+        bool anyDirty = false;
+        chrono::steady_clock::time_point firstDirty;
+        auto markDirty = [&](size_t job) {
+            if (!anyDirty) firstDirty = chrono::steady_clock::now();
+            dirty[job] = anyDirty = true;
+        };
+        while (!watchStopRequested) {
+            // Block until something happens, then keep draining until the directory has been quiet for a while,
+            // or until the first change has waited kWatchMaxDelayMs.
+            int timeoutMs = 1000;
+            if (anyDirty) {
+                auto waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - firstDirty).count();
+                timeoutMs = int(max<long long>(0, min<long long>(kWatchDebounceMs, kWatchMaxDelayMs - waited)));
+            }
+            pollfd pending{ inotifyFd, POLLIN, 0 };
+            int ready = poll(&pending, 1, timeoutMs);
+            if (ready < 0 && errno != EINTR) break;
+
+            if (ready > 0) {
+                ssize_t length;
+                while ((length = read(inotifyFd, events, sizeof(events))) > 0) {
+                    for (char* cursor = events; cursor < events + length; ) {
+                        auto* event = reinterpret_cast<inotify_event*>(cursor);
+                        cursor += sizeof(inotify_event) + event->len;
+                        // Events were dropped, so any job may have missed a change.
+                        if (event->mask & IN_Q_OVERFLOW) {
+                            for (size_t i = 0; i < jobs.size(); ++i) markDirty(i);
+                            continue;
+                        }
+                        if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+
+                        // Only names matching a job's pattern count, so outputs written nearby do not retrigger it.
+                        for (size_t i = 0; i < jobs.size(); ++i) {
+                            for (const auto & pattern : jobs[i].inputPatterns) {
+                                fs::path patternPath(pattern);
+                                string directory = patternPath.has_parent_path() ? patternPath.parent_path().string() : ".";
+                                if (directory == watchedDirectories[event->wd] &&
+                                    MatchesWildcard(event->name, patternPath.filename().string())) {
+                                    markDirty(i);
+                                }
+                            }
+                        }
+                    }
+                }
+                bool overdue = anyDirty && chrono::steady_clock::now() - firstDirty >= chrono::milliseconds(kWatchMaxDelayMs);
+                if (!overdue) continue;
+            }
+
+            // Quiet period elapsed, or the changes have waited long enough.
+            if (anyDirty) {
+                for (size_t i = 0; i < jobs.size(); ++i) {
+                    if (dirty[i]) IncrementalUpdate(jobs[i]);
+                    dirty[i] = false;
+                }
+                anyDirty = false;
+            }
+        }
+        close(inotifyFd);
+        return 0;
+    }
+    cerr << "ERROR: inotify unavailable (" << strerror(errno) << "), falling back to polling" << endl;
+#endif
+
+    // IncrementalUpdate only stats unchanged files, so polling stays cheap.
+    while (!watchStopRequested) {
+        this_thread::sleep_for(chrono::milliseconds(kWatchPollMs));
+        for (const auto & job : jobs) {
+            IncrementalUpdate(job);
+        }
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Indexed Output
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Layout, all integers little-endian as written by this machine:
+//   IndexedOutputHeader
+//   string bytes                        every entry back to back, in sorted order
+//   uint64 offsets[entryCount + 1]      into the string bytes
+//   uint64 blockKeyOffsets[blockCount + 1]
+//   block key bytes                     a copy of the first entry of every block of blockSize entries
+// The block keys are a small sparse index: a lookup narrows to one block there, then searches the offsets.
+struct IndexedOutputHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t sortType;
+    uint32_t reserved;
+    uint64_t entryCount;
+    uint64_t blockSize;
+    uint64_t blockCount;
+    uint64_t stringBytes;
+};
+
+static const char kIndexedOutputMagic[4] = { 'T', 'F', 'S', 'I' };
+static const uint64_t kIndexedBlockSize = 64;
+
+// Strict version of IsFirstAboveSecond, which is not strict for every sort type on equal strings.
+bool SortsBefore(IStringComparer* stringComparer, const string& first, const string& second) {
+    return first != second && stringComparer->IsFirstAboveSecond(first, second);
+}
+
+void WriteIndexedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, EIoMode ioMode) {
+    error_code ec;
+    fs::remove(filePath, ec);
+
+    IndexedOutputHeader header{};
+    memcpy(header.magic, kIndexedOutputMagic, 4);
+    header.version = 1;
+    header.sortType = uint32_t(sortType);
+    header.entryCount = lines.size();
+    header.blockSize = kIndexedBlockSize;
+    header.blockCount = (lines.size() + kIndexedBlockSize - 1) / kIndexedBlockSize;
+    for (const auto & line : lines) header.stringBytes += line.size();
+
+    FileSink fileOut(filePath, ioMode);
+    fileOut.Write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto & line : lines) {
+        fileOut.Write(line.data(), line.size());
+    }
+
+    uint64_t offset = 0;
+    fileOut.Write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    for (const auto & line : lines) {
+        offset += line.size();
+        fileOut.Write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+
+    offset = 0;
+    fileOut.Write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    for (uint64_t block = 0; block < header.blockCount; ++block) {
+        offset += lines[block * kIndexedBlockSize].size();
+        fileOut.Write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+    for (uint64_t block = 0; block < header.blockCount; ++block) {
+        const string& key = lines[block * kIndexedBlockSize];
+        fileOut.Write(key.data(), key.size());
+    }
+    fileOut.Close();
+}
+
+static uint64_t ReadUint64At(const char* table, uint64_t index) {
+    uint64_t value;
+    memcpy(&value, table + index * sizeof(uint64_t), sizeof(value));
+    return value;
+}
+
+// True when the count offsets in table start at zero, never decrease and stay within limit.
+static bool OffsetsInOrder(const char* table, uint64_t count, uint64_t limit) {
+    uint64_t previous = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t offset = ReadUint64At(table, i);
+        if (offset < previous || offset > limit || (i == 0 && offset != 0)) return false;
+        previous = offset;
+    }
+    return true;
+}
+
+bool IndexedOutputReader::Open(const string& path) {
+    mapping = make_shared<MappedFile>(path);
+    if (!mapping->IsOpen() || mapping->Size() < sizeof(IndexedOutputHeader)) return false;
+
+    IndexedOutputHeader header{};
+    memcpy(&header, mapping->Data(), sizeof(header));
+    if (memcmp(header.magic, kIndexedOutputMagic, 4) != 0 || header.version != 1 || header.blockSize == 0) return false;
+
+    // Make sure every table lies inside the file before trusting any offset in it. Each size is taken from
+    // what is left of the file, so damaged counts cannot wrap the arithmetic.
+    uint64_t remaining = mapping->Size() - sizeof(header);
+    if (header.stringBytes > remaining) return false;
+    remaining -= header.stringBytes;
+    if (header.entryCount >= remaining / sizeof(uint64_t)) return false;
+    remaining -= (header.entryCount + 1) * sizeof(uint64_t);
+    if (header.blockCount >= remaining / sizeof(uint64_t)) return false;
+    remaining -= (header.blockCount + 1) * sizeof(uint64_t);
+    if (header.blockCount != header.entryCount / header.blockSize + (header.entryCount % header.blockSize != 0)) return false;
+
+    sortType = ESortType(header.sortType);
+    entryCount = header.entryCount;
+    blockSize = header.blockSize;
+    blockCount = header.blockCount;
+    strings = mapping->Data() + sizeof(header);
+    offsets = strings + header.stringBytes;
+    blockKeyOffsets = offsets + (entryCount + 1) * sizeof(uint64_t);
+    blockKeys = blockKeyOffsets + (blockCount + 1) * sizeof(uint64_t);
+    if (!OffsetsInOrder(offsets, entryCount + 1, header.stringBytes) || ReadUint64At(offsets, entryCount) != header.stringBytes ||
+        !OffsetsInOrder(blockKeyOffsets, blockCount + 1, remaining)) {
+        return false;
+    }
+    stringComparer = MakeComparer(sortType);
+    return true;
+}
+
+string_view IndexedOutputReader::At(size_t index) const {
+    uint64_t begin = ReadUint64At(offsets, index);
+    uint64_t end = ReadUint64At(offsets, index + 1);
+    return string_view(strings + begin, size_t(end - begin));
+}
+
+// First entry for which isBefore is false. isBefore must hold for a leading run of entries and nothing after.
+size_t IndexedOutputReader::PartitionPoint(const function<bool(const string&)>& isBefore) const {
+    // Find the last block whose first key is still before the point, only its entries can hold it.
+    uint64_t low = 0, high = blockCount;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        uint64_t begin = ReadUint64At(blockKeyOffsets, mid);
+        string blockKey(blockKeys + begin, size_t(ReadUint64At(blockKeyOffsets, mid + 1) - begin));
+        if (isBefore(blockKey)) low = mid + 1;
+        else high = mid;
+    }
+    if (low == 0) return 0;
+
+    uint64_t first = (low - 1) * blockSize;
+    uint64_t last = min(entryCount, low * blockSize);
+    while (first < last) {
+        uint64_t mid = first + (last - first) / 2;
+        if (isBefore(string(At(mid)))) first = mid + 1;
+        else last = mid;
+    }
+    return size_t(first);
+}
+
+// First entry that does not sort before key, or Count() if there is none.
+size_t IndexedOutputReader::LowerBound(const string& key) const {
+    return PartitionPoint([this, &key](const string& entry) { return SortsBefore(stringComparer.get(), entry, key); });
+}
+
+void IndexedOutputReader::ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const {
+    for (size_t i = from; i < to && i < Count(); ++i) {
+        visit(string(At(i)));
+    }
+}
+
+bool IndexedOutputReader::Contains(const string& key) const {
+    size_t index = LowerBound(key);
+    return index < Count() && At(index) == key;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Front-Coded Output
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Layout, all integers little-endian as written by this machine:
+//   FrontCodedHeader
+//   entries                              varint shared, varint rest length, rest bytes
+//   uint64 restartOffsets[restartCount]  into the entries, one per restartInterval entries
+// Each entry reuses "shared" bytes of the one before it. Alphabetical outputs share leading bytes,
+// LastLetter outputs are ordered from the back, so neighbours there share trailing bytes instead.
+// Restart entries share nothing and can be decoded on their own.
+struct FrontCodedHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t sortType;
+    uint32_t restartInterval;
+    uint64_t entryCount;
+    uint64_t restartCount;
+    uint64_t entryBytes;
+};
+
+static const char kFrontCodedMagic[4] = { 'T', 'F', 'F', 'C' };
+static const uint32_t kFrontCodedRestartInterval = 16;
+
+static void AppendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static bool ReadVarint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+        auto byte = static_cast<unsigned char>(*cursor++);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// An empty "previous" writes a self-contained entry.
+void AppendFrontCoded(string& out, const string& previous, const string& current, bool shareSuffix) {
+    size_t shared = 0;
+    size_t limit = min(previous.size(), current.size());
+    if (shareSuffix) {
+        while (shared < limit && previous[previous.size() - 1 - shared] == current[current.size() - 1 - shared]) ++shared;
+    } else {
+        while (shared < limit && previous[shared] == current[shared]) ++shared;
+    }
+    AppendVarint(out, shared);
+    AppendVarint(out, current.size() - shared);
+    if (shareSuffix) out.append(current, 0, current.size() - shared);
+    else out.append(current, shared, string::npos);
+}
+
+bool ReadFrontCoded(const char*& cursor, const char* end, string& previousInOut, bool shareSuffix) {
+    uint64_t shared, restLength;
+    if (!ReadVarint(cursor, end, shared) || !ReadVarint(cursor, end, restLength)) return false;
+    if (shared > previousInOut.size() || restLength > uint64_t(end - cursor)) return false;
+    if (shareSuffix) {
+        previousInOut = string(cursor, size_t(restLength)) + previousInOut.substr(previousInOut.size() - shared);
+    } else {
+        previousInOut.resize(size_t(shared));
+        previousInOut.append(cursor, size_t(restLength));
+    }
+    cursor += restLength;
+    return true;
+}
+
+void WriteFrontCodedOutput(const vector<string>& lines, const string& filePath, ESortType sortType, EIoMode ioMode) {
+    error_code ec;
+    fs::remove(filePath, ec);
+
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string encoded;
+    vector<uint64_t> restartOffsets;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        bool isRestart = i % kFrontCodedRestartInterval == 0;
+        if (isRestart) restartOffsets.push_back(encoded.size());
+        AppendFrontCoded(encoded, isRestart ? string() : lines[i - 1], lines[i], shareSuffix);
+    }
+
+    FrontCodedHeader header{};
+    memcpy(header.magic, kFrontCodedMagic, 4);
+    header.version = 1;
+    header.sortType = uint32_t(sortType);
+    header.restartInterval = kFrontCodedRestartInterval;
+    header.entryCount = lines.size();
+    header.restartCount = restartOffsets.size();
+    header.entryBytes = encoded.size();
+
+    FileSink fileOut(filePath, ioMode);
+    fileOut.Write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fileOut.Write(encoded.data(), encoded.size());
+    fileOut.Write(reinterpret_cast<const char*>(restartOffsets.data()), restartOffsets.size() * sizeof(uint64_t));
+    fileOut.Close();
+}
+
+bool FrontCodedReader::Open(const string& path) {
+    mapping = make_shared<MappedFile>(path);
+    if (!mapping->IsOpen() || mapping->Size() < sizeof(FrontCodedHeader)) return false;
+
+    FrontCodedHeader header{};
+    memcpy(&header, mapping->Data(), sizeof(header));
+    if (memcmp(header.magic, kFrontCodedMagic, 4) != 0 || header.version != 1 || header.restartInterval == 0) return false;
+    // Sizes are taken from what is left of the file, and every restart must be one of the entries.
+    uint64_t remaining = mapping->Size() - sizeof(header);
+    if (header.entryBytes > remaining || header.restartCount > (remaining - header.entryBytes) / sizeof(uint64_t)) return false;
+    uint64_t restartsNeeded = header.entryCount / header.restartInterval + (header.entryCount % header.restartInterval != 0);
+    if (header.restartCount != restartsNeeded) return false;
+
+    sortType = ESortType(header.sortType);
+    entryCount = header.entryCount;
+    restartInterval = header.restartInterval;
+    restartCount = header.restartCount;
+    entries = mapping->Data() + sizeof(header);
+    entriesEnd = entries + header.entryBytes;
+    restartOffsets = entriesEnd;
+    if (!OffsetsInOrder(restartOffsets, restartCount, header.entryBytes)) return false;
+    stringComparer = MakeComparer(sortType);
+    return true;
+}
+
+string FrontCodedReader::At(size_t index) const {
+    const char* cursor = entries + ReadUint64At(restartOffsets, index / restartInterval);
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string entry;
+    for (size_t i = 0; i <= index % restartInterval; ++i) {
+        if (!ReadFrontCoded(cursor, entriesEnd, entry, shareSuffix)) return string();
+    }
+    return entry;
+}
+
+// First entry for which isBefore is false. isBefore must hold for a leading run of entries and nothing after.
+size_t FrontCodedReader::PartitionPoint(const function<bool(const string&)>& isBefore) const {
+    // Restart entries decode in one step, so binary search over them first.
+    uint64_t low = 0, high = restartCount;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (isBefore(At(size_t(mid * restartInterval)))) low = mid + 1;
+        else high = mid;
+    }
+    if (low == 0) return 0;
+
+    // Then walk the one block that can hold the point.
+    size_t index = size_t((low - 1) * restartInterval);
+    const char* cursor = entries + ReadUint64At(restartOffsets, low - 1);
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string entry;
+    for (; index < entryCount && index < low * restartInterval; ++index) {
+        if (!ReadFrontCoded(cursor, entriesEnd, entry, shareSuffix)) break;
+        if (!isBefore(entry)) return index;
+    }
+    return index;
+}
+
+// First entry that does not sort before key, or Count() if there is none.
+size_t FrontCodedReader::LowerBound(const string& key) const {
+    return PartitionPoint([this, &key](const string& entry) { return SortsBefore(stringComparer.get(), entry, key); });
+}
+
+void FrontCodedReader::ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const {
+    if (from >= to || from >= Count()) return;
+    const char* cursor = entries + ReadUint64At(restartOffsets, from / restartInterval);
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string entry;
+    for (size_t i = from - from % restartInterval; i < to && i < Count(); ++i) {
+        if (!ReadFrontCoded(cursor, entriesEnd, entry, shareSuffix)) return;
+        if (i >= from) visit(entry);
+    }
+}
+
+bool FrontCodedReader::Contains(const string& key) const {
+    size_t index = LowerBound(key);
+    return index < Count() && At(index) == key;
+}
+
+void FrontCodedReader::ForEach(const function<void(const string&)>& visit) const {
+    const char* cursor = entries;
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string entry;
+    for (uint64_t i = 0; i < entryCount; ++i) {
+        if (!ReadFrontCoded(cursor, entriesEnd, entry, shareSuffix)) return;
+        visit(entry);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queries
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool TextOutputReader::Open(const string& path) {
+    mapping = make_shared<MappedFile>(path);
+    return mapping->IsOpen();
+}
+
+size_t TextOutputReader::LineEnd(size_t start) const {
+    const void* newline = memchr(mapping->Data() + start, '\n', mapping->Size() - start);
+    return newline ? size_t(static_cast<const char*>(newline) - mapping->Data()) : mapping->Size();
+}
+
+// Byte offset of the first line for which isBefore is false, found by bisecting bytes and realigning
+// each probe to the next line start.
+size_t TextOutputReader::PartitionPoint(const function<bool(const string&)>& isBefore) const {
+    // Lines starting before low are before the point, lines starting at or after high are not.
+    size_t low = 0, high = mapping->Size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t start = mid == 0 ? 0 : LineEnd(mid - 1) + 1;
+        if (start >= high) {
+            high = mid;
+            continue;
+        }
+        size_t end = LineEnd(start);
+        if (isBefore(string(mapping->Data() + start, end - start))) low = end + 1;
+        else high = start;
+    }
+    return min(low, mapping->Size());
+}
+
+void TextOutputReader::ForEachBetween(size_t from, size_t to, const function<void(const string&)>& visit) const {
+    while (from < to && from < mapping->Size()) {
+        size_t end = LineEnd(from);
+        visit(string(mapping->Data() + from, end - from));
+        from = end + 1;
+    }
+}
+
+// True when a few neighbouring lines at each of probeCount evenly spread offsets are in sortType order.
+// Text carries no sort type, so this catches a wrong sort= cheaply without reading the whole output.
+bool TextOutputReader::LooksSorted(ESortType sortType, size_t probeCount) const {
+    const size_t linesPerProbe = 4;
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    string previous, line;
+    for (size_t probe = 0; probe < probeCount; ++probe) {
+        size_t offset = size_t(uint64_t(mapping->Size()) * probe / probeCount);
+        size_t start = offset == 0 ? 0 : LineEnd(offset - 1) + 1;
+        for (size_t i = 0; i < linesPerProbe && start < mapping->Size(); ++i) {
+            size_t end = LineEnd(start);
+            line.assign(mapping->Data() + start, end - start);
+            if (i > 0 && SortsBefore(stringComparer.get(), line, previous)) return false;
+            swap(previous, line);
+            start = end + 1;
+        }
+    }
+    return true;
+}
+
+// Every answer is one contiguous run of the output, bounded by two partition points.
+template <typename TReader>
+static void AnswerQuery(const TReader& reader, ESortType sortType, const string& kind, const vector<string>& operands) {
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    IStringComparer* comparer = stringComparer.get();
+    auto print = [](const string& line) { cout << line << '\n'; };
+
+    if (kind == "exact") {
+        const string& key = operands[0];
+        size_t from = reader.PartitionPoint([&](const string& line) { return SortsBefore(comparer, line, key); });
+        size_t to = reader.PartitionPoint([&](const string& line) { return SortsBefore(comparer, line, key) || line == key; });
+        reader.ForEachBetween(from, to, print);
+    } else if (kind == "prefix" || kind == "suffix") {
+        // Everything carrying the affix sits together: after the lines that sort before the affix without
+        // carrying it, and before everything else.
+        const string& affix = operands[0];
+        bool isPrefix = kind == "prefix";
+        auto hasAffix = [&](const string& line) {
+            if (line.size() < affix.size()) return false;
+            return isPrefix ? line.compare(0, affix.size(), affix) == 0
+                            : line.compare(line.size() - affix.size(), affix.size(), affix) == 0;
+        };
+        size_t from = reader.PartitionPoint([&](const string& line) { return !hasAffix(line) && SortsBefore(comparer, line, affix); });
+        size_t to = reader.PartitionPoint([&](const string& line) { return hasAffix(line) || SortsBefore(comparer, line, affix); });
+        reader.ForEachBetween(from, to, print);
+    } else if (kind == "range") {
+        const string& low = operands[0];
+        const string& high = operands[1];
+        size_t from = reader.PartitionPoint([&](const string& line) { return SortsBefore(comparer, line, low); });
+        size_t to = reader.PartitionPoint([&](const string& line) { return SortsBefore(comparer, line, high) || line == high; });
+        reader.ForEachBetween(from, to, print);
+    }
+}
+
+static const size_t kQueryOrderProbes = 64;
+
+// --query <output> <kind> <operand>... [sort=<SortType>]
+// Binary outputs carry their sort type, plain text needs sort= unless it is AlphAsc. A text output found
+// out of that order is refused rather than bisected into wrong answers.
+int RunQuery(const vector<string>& args) {
+    vector<string> positional;
+    ESortType sortType = ESortType::AlphAsc;
+    bool sortTypeGiven = false;
+    for (const auto & arg : args) {
+        if (arg.rfind("sort=", 0) == 0) {
+            if (!ParseSortType(arg.substr(5), sortType)) {
+                cerr << "ERROR: unknown sort type: " << arg.substr(5) << endl;
+                return 1;
+            }
+            sortTypeGiven = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() < 3) {
+        cerr << "ERROR: expected <output> <kind> <operand>..." << endl;
+        return 1;
+    }
+    const string& path = positional[0];
+    const string& kind = positional[1];
+    vector<string> operands(positional.begin() + 2, positional.end());
+    size_t expectedOperands = kind == "range" ? 2 : 1;
+    if ((kind != "exact" && kind != "prefix" && kind != "suffix" && kind != "range") || operands.size() != expectedOperands) {
+        cerr << "ERROR: unknown query or wrong operand count: " << kind << endl;
+        return 1;
+    }
+
+    IndexedOutputReader indexedReader;
+    FrontCodedReader frontCodedReader;
+    TextOutputReader textReader;
+    ESortType fileSortType = sortType;
+    bool isIndexed = indexedReader.Open(path);
+    bool isFrontCoded = !isIndexed && frontCodedReader.Open(path);
+    if (isIndexed) fileSortType = indexedReader.SortType();
+    else if (isFrontCoded) fileSortType = frontCodedReader.SortType();
+    else if (!textReader.Open(path)) {
+        cerr << "ERROR: unable to open output: " << path << endl;
+        return 1;
+    } else if (DetectFileCompression(path) != ECompression::None) {
+        cerr << "ERROR: compressed outputs cannot be searched in place: " << path << endl;
+        return 1;
+    } else if (!textReader.LooksSorted(sortType, kQueryOrderProbes)) {
+        cerr << "ERROR: " << path << " is not in the order of the " << (sortTypeGiven ? "requested" : "default AlphAsc")
+             << " sort type, pass the sort= it was written with" << endl;
+        return 1;
+    }
+    if (sortTypeGiven && fileSortType != sortType) {
+        cerr << "ERROR: " << path << " was not written with the requested sort type" << endl;
+        return 1;
+    }
+
+    // Prefixes are only contiguous in alphabetical outputs, suffixes only in LastLetter ones.
+    bool isLastLetter = fileSortType == ESortType::LastLetterAsc;
+    if ((kind == "prefix" && isLastLetter) || (kind == "suffix" && !isLastLetter)) {
+        cerr << "ERROR: " << kind << " queries need " << (isLastLetter ? "an alphabetical" : "a LastLetterAsc") << " output" << endl;
+        return 1;
+    }
+
+    if (isIndexed) AnswerQuery(indexedReader, fileSortType, kind, operands);
+    else if (isFrontCoded) AnswerQuery(frontCodedReader, fileSortType, kind, operands);
+    else AnswerQuery(textReader, fileSortType, kind, operands);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Set Operations
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Next line that passes the usual input checks. Empty lines are skipped, rejected ones reported when asked.
+static bool NextValidLine(istream& in, string& line, const string& fileName, bool reportRejected) {
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        if (ContainsSpecial(line)) {
+            if (reportRejected) {
+                cerr << "ERROR: special characters or numbers: " << line << " in file: " << fileName << endl;
+                cerr << line << " has been removed" << endl;
+            }
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+// One pass, only the previous line in memory. Lines the merge will reject do not count.
+bool IsSortedFile(const string& fileName, IStringComparer* stringComparer) {
+    ifstream fileIn(fileName);
+    string previous, line;
+    bool first = true;
+    while (NextValidLine(fileIn, line, fileName, false)) {
+        if (!first && SortsBefore(stringComparer, line, previous)) return false;
+        previous.swap(line);
+        first = false;
+    }
+    return true;
+}
+
+// Sorts an input through spilled runs into a temporary text file, holding about one run in memory.
+static bool SortInputToFile(const string& input, const string& temporary, ESortType sortType, const SortOptions& options) {
+    ifstream fileIn(input);
+    if (!fileIn) {
+        cerr << "ERROR: unable to open " << input << endl;
+        return false;
+    }
+    RunSpiller spiller(SpillDirectoryFor(options), fs::path(temporary).filename().string(), sortType, options.spillRunBytes,
+                       options.ioMode);
+    vector<string> batch;
+    string line;
+    size_t batchBytes = 0;
+    while (NextValidLine(fileIn, line, input, true)) {
+        batchBytes += line.size() + sizeof(string);
+        batch.push_back(std::move(line));
+        if (batchBytes >= options.spillRunBytes / 4) {
+            spiller.Add(MergeSortWrapper(std::move(batch), sortType));
+            batch = vector<string>();
+            batchBytes = 0;
+        }
+    }
+    if (!batch.empty()) spiller.Add(MergeSortWrapper(std::move(batch), sortType));
+    spiller.Finish();
+
+    FileSink fileOut(temporary, EIoMode::Default);
+    spiller.Merge([&fileOut](const string& sorted) {
+        fileOut.Write(sorted);
+        fileOut.Write("\n", 1);
+    });
+    return fileOut.Close();
+}
+
+// --setop <operation> <SortType> <output> <input> <input>... [key=value ...]
+// Inputs are treated as sets: duplicate lines collapse. diff keeps lines of the first input found in no other.
+int RunSetOperation(const vector<string>& args) {
+    if (args.size() < 5) {
+        cerr << "ERROR: expected <operation> <SortType> <output> <input> <input>..." << endl;
+        return 1;
+    }
+    const string& operation = args[0];
+    if (operation != "intersect" && operation != "union" && operation != "diff") {
+        cerr << "ERROR: unknown set operation: " << operation << endl;
+        return 1;
+    }
+
+    ESortType sortType;
+    if (!ParseSortType(args[1], sortType)) {
+        cerr << "ERROR: unknown sort type: " << args[1] << endl;
+        return 1;
+    }
+    // A key=value token that is not an existing file must be a known option.
+    SortOptions options;
+    vector<string> inputs;
+    for (size_t i = 3; i < args.size(); ++i) {
+        size_t eq = args[i].find('=');
+        error_code ec;
+        if (eq != string::npos && !fs::exists(args[i], ec)) {
+            if (!ApplyOption(options, args[i].substr(0, eq), args[i].substr(eq + 1))) {
+                cerr << "ERROR: unknown option '" << args[i] << "'" << endl;
+                return 1;
+            }
+            continue;
+        }
+        inputs.push_back(args[i]);
+    }
+    if (inputs.size() < 2) {
+        cerr << "ERROR: set operations need at least two inputs" << endl;
+        return 1;
+    }
+    if (options.format != EOutputFormat::Text || options.shardMethod != EShardMethod::None ||
+        options.compression != ECompression::None) {
+        cerr << "ERROR: set operations stream their result and only write unsharded, uncompressed format=text" << endl;
+        return 1;
+    }
+    if (options.writeMethod != EWriteMethod::Stream) {
+        cerr << "ERROR: set operations stream their result, writer=pwrite|mmap need the whole output up front" << endl;
+        return 1;
+    }
+    string unsupported = UnsupportedSpillOption(options, true);
+    if (!unsupported.empty()) {
+        cerr << "ERROR: " << unsupported << " is not supported with --setop" << endl;
+        return 1;
+    }
+
+    clock_t startTime = clock();
+    string outputPath = OutputPathFor(args[2], options);
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+
+    // Inputs not already in this order are sorted into a temporary file first.
+    vector<string> temporaries;
+    auto removeTemporaries = [&temporaries]() {
+        error_code ec;
+        for (const auto & temporary : temporaries) fs::remove(temporary, ec);
+    };
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (IsSortedFile(inputs[i], stringComparer.get())) continue;
+        string temporary = outputPath + ".setop" + to_string(i) + ".tmp";
+        temporaries.push_back(temporary);
+        bool sorted = false;
+        try {
+            sorted = SortInputToFile(inputs[i], temporary, sortType, options);
+        } catch (const exception& e) {
+            cerr << "ERROR: sorting " << inputs[i] << " failed: " << e.what() << endl;
+        }
+        if (!sorted) {
+            removeTemporaries();
+            return 1;
+        }
+        inputs[i] = temporary;
+    }
+
+    vector<unique_ptr<ifstream>> streams;
+    vector<string> heads(inputs.size());
+    vector<bool> hasHead(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        streams.push_back(make_unique<ifstream>(inputs[i]));
+        if (!*streams[i]) {
+            cerr << "ERROR: unable to open " << inputs[i] << endl;
+            removeTemporaries();
+            return 1;
+        }
+        hasHead[i] = NextValidLine(*streams[i], heads[i], inputs[i], true);
+    }
+
+    error_code ec;
+    fs::remove(outputPath, ec);
+    FileSink fileOut(outputPath, options.ioMode);
+    while (true) {
+        // The smallest head across all inputs is the next candidate.
+        int smallest = -1;
+        for (size_t i = 0; i < heads.size(); ++i) {
+            if (hasHead[i] && (smallest < 0 || SortsBefore(stringComparer.get(), heads[i], heads[smallest]))) {
+                smallest = int(i);
+            }
+        }
+        if (smallest < 0) break;
+        string candidate = heads[smallest];
+
+        // Count the inputs holding it and move each of them past every copy.
+        size_t holders = 0;
+        bool inFirst = false;
+        for (size_t i = 0; i < heads.size(); ++i) {
+            if (!hasHead[i] || heads[i] != candidate) continue;
+            ++holders;
+            inFirst |= i == 0;
+            while ((hasHead[i] = NextValidLine(*streams[i], heads[i], inputs[i], true)) && heads[i] == candidate) {}
+        }
+
+        bool keep = (operation == "union") ||
+                    (operation == "intersect" && holders == inputs.size()) ||
+                    (operation == "diff" && inFirst && holders == 1);
+        if (keep) {
+            fileOut.Write(candidate);
+            fileOut.Write("\n", 1);
+        }
+    }
+    fileOut.Close();
+
+    removeTemporaries();
+    PrintTime(outputPath, int(clock() - startTime));
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// External Sorting
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+////// Block Compression
+// Byte-oriented LZ77 in the style of LZ4. A sequence is a token (literal count in the high nibble, match
+// length minus kLzMinMatch in the low one, 15 meaning more length bytes follow), the literals, a 16-bit back
+// offset and the extra length bytes. The last sequence has literals only. Front-coded runs repeat short
+// fragments constantly, which is what this is good at, and decoding is a plain copy loop.
+static const size_t kLzMinMatch = 4;
+static const int kLzHashBits = 14;
+
+static void AppendLzLength(string& out, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) out.push_back(char(255));
+    out.push_back(char(length));
+}
+
+static bool ReadLzLength(const unsigned char*& cursor, const unsigned char* end, size_t& length) {
+    unsigned char byte;
+    do {
+        if (cursor == end) return false;
+        byte = *cursor++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+void LzCompress(const char* data, size_t size, string& out) {
+    // Last position + 1 of every hashed 4-byte sequence, 0 for none.
+    vector<uint32_t> table(size_t(1) << kLzHashBits, 0);
+    size_t anchor = 0, i = 0;
+    auto appendLiterals = [&](size_t literals, unsigned char matchNibble) {
+        out.push_back(char((min<size_t>(literals, 15) << 4) | matchNibble));
+        if (literals >= 15) AppendLzLength(out, literals);
+        out.append(data + anchor, literals);
+    };
+
+    while (i + kLzMinMatch <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, data + i, sizeof(sequence));
+        uint32_t slot = (sequence * 2654435761u) >> (32 - kLzHashBits);
+        size_t candidate = table[slot];
+        table[slot] = uint32_t(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > 0xFFFF || memcmp(data + candidate - 1, data + i, kLzMinMatch) != 0) {
+            ++i;
+            continue;
+        }
+
+        size_t from = candidate - 1;
+        size_t length = kLzMinMatch;
+        while (i + length < size && data[from + length] == data[i + length]) ++length;
+        size_t extra = length - kLzMinMatch;
+        size_t offset = i - from;
+        appendLiterals(i - anchor, (unsigned char)min<size_t>(extra, 15));
+        out.push_back(char(offset & 0xFF));
+        out.push_back(char(offset >> 8));
+        if (extra >= 15) AppendLzLength(out, extra);
+        i += length;
+        anchor = i;
+    }
+    appendLiterals(size - anchor, 0);
+}
+
+// Fails on anything that would read or write out of bounds or does not fill out exactly.
+bool LzDecompress(const char* data, size_t size, char* out, size_t outSize) {
+    auto cursor = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = cursor + size;
+    size_t written = 0;
+    while (cursor < end) {
+        unsigned char token = *cursor++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !ReadLzLength(cursor, end, literals)) return false;
+        if (literals > size_t(end - cursor) || literals > outSize - written) return false;
+        memcpy(out + written, cursor, literals);
+        cursor += literals;
+        written += literals;
+        if (cursor == end) break;
+
+        if (end - cursor < 2) return false;
+        size_t offset = size_t(cursor[0]) | size_t(cursor[1]) << 8;
+        cursor += 2;
+        size_t length = token & 15;
+        if (length == 15 && !ReadLzLength(cursor, end, length)) return false;
+        length += kLzMinMatch;
+        if (offset == 0 || offset > written || length > outSize - written) return false;
+        // Byte by byte, a match may overlap the bytes it produces.
+        for (size_t k = 0; k < length; ++k, ++written) out[written] = out[written - offset];
+    }
+    return written == outSize;
+}
+
+
+////// Spilled Runs
+// Layout, all integers little-endian as written by this machine:
+//   SpillRunHeader
+//   blocks                 SpillBlockHeader then storedBytes of payload
+// A block's raw bytes are front-coded entries of lineCount lines, restarting at the block start, so every
+// block decodes on its own. The payload is those bytes LZ-compressed, or stored as is when that is no smaller.
+struct SpillRunHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t sortType;
+    uint32_t reserved;
+    uint64_t lineCount;
+};
+
+struct SpillBlockHeader {
+    uint32_t rawBytes;
+    uint32_t storedBytes;
+    uint32_t lineCount;
+    uint32_t codec;
+    uint64_t rawHash;
+};
+
+static const char kSpillRunMagic[4] = { 'T', 'F', 'S', 'R' };
+static const size_t kSpillBlockBytes = 128 * 1024;
+enum ESpillCodec : uint32_t { SpillStored = 0, SpillLz = 1 };
+
+// fileHash, when given, receives HashBytes of the whole file as written. False if a line is too long for
+// a block's 32-bit sizes.
+bool WriteSpillRun(const vector<string>& lines, const string& path, ESortType sortType, EIoMode ioMode, uint64_t* fileHash) {
+    SpillRunHeader header{};
+    memcpy(header.magic, kSpillRunMagic, 4);
+    header.version = 1;
+    header.sortType = uint32_t(sortType);
+    header.lineCount = lines.size();
+
+    FileSink fileOut(path, ioMode);
+    uint64_t hash = HashBytes(reinterpret_cast<const char*>(&header), sizeof(header));
+    fileOut.Write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    bool shareSuffix = sortType == ESortType::LastLetterAsc;
+    string raw, compressed;
+    uint32_t blockLines = 0;
+    auto flushBlock = [&]() {
+        compressed.clear();
+        LzCompress(raw.data(), raw.size(), compressed);
+        bool useLz = compressed.size() < raw.size();
+        const string& payload = useLz ? compressed : raw;
+        SpillBlockHeader block{};
+        block.rawBytes = uint32_t(raw.size());
+        block.storedBytes = uint32_t(payload.size());
+        block.lineCount = blockLines;
+        block.codec = useLz ? SpillLz : SpillStored;
+        block.rawHash = HashBytes(raw.data(), raw.size());
+        hash = HashBytes(reinterpret_cast<const char*>(&block), sizeof(block), hash);
+        hash = HashBytes(payload.data(), payload.size(), hash);
+        fileOut.Write(reinterpret_cast<const char*>(&block), sizeof(block));
+        fileOut.Write(payload);
+        raw.clear();
+        blockLines = 0;
+    };
+
+    // An entry is at most the line plus two varints, so a block that could pass UINT32_MAX is flushed first.
+    const size_t entryOverhead = 20;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (lines[i].size() > UINT32_MAX - entryOverhead) {
+            cerr << "ERROR: a line of " << lines[i].size() << " bytes is too long to spill" << endl;
+            return false;
+        }
+        if (blockLines > 0 && raw.size() + lines[i].size() + entryOverhead > UINT32_MAX) flushBlock();
+        AppendFrontCoded(raw, blockLines == 0 ? string() : lines[i - 1], lines[i], shareSuffix);
+        ++blockLines;
+        if (raw.size() >= kSpillBlockBytes) flushBlock();
+    }
+    if (blockLines > 0) flushBlock();
+    if (fileHash) *fileHash = hash;
+    return fileOut.Close();
+}
+
+// Flushes a closed file's data to the device, so a log entry naming it is never ahead of its contents.
+static bool SyncFile(const string& path) {
+#if !defined(_WIN32)
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+#else
+    (void)path;
+    return true;
+#endif
+}
+
+// Decompresses and front-decodes one block. False if it is damaged.
+static bool DecodeSpillBlock(const SpillBlockHeader& block, const char* payload, bool shareSuffix, vector<string>& linesOut) {
+    string raw;
+    const char* rawData = payload;
+    if (block.codec == SpillLz) {
+        raw.resize(block.rawBytes);
+        if (!LzDecompress(payload, block.storedBytes, raw.data(), raw.size())) return false;
+        rawData = raw.data();
+    } else if (block.codec != SpillStored || block.storedBytes != block.rawBytes) {
+        return false;
+    }
+    if (HashBytes(rawData, block.rawBytes) != block.rawHash) return false;
+
+    const char* cursor = rawData;
+    const char* end = rawData + block.rawBytes;
+    string entry;
+    linesOut.clear();
+    linesOut.reserve(block.lineCount);
+    for (uint32_t i = 0; i < block.lineCount; ++i) {
+        if (!ReadFrontCoded(cursor, end, entry, shareSuffix)) return false;
+        linesOut.push_back(entry);
+    }
+    return cursor == end;
+}
+
+bool SpillRunReader::Open(const string& runPath, WorkerPool& decoderPool) {
+    path = runPath;
+    decoders = &decoderPool;
+    mapping = make_shared<MappedFile>(path);
+    if (!mapping->IsOpen() || mapping->Size() < sizeof(SpillRunHeader)) return false;
+    SpillRunHeader header{};
+    memcpy(&header, mapping->Data(), sizeof(header));
+    if (memcmp(header.magic, kSpillRunMagic, 4) != 0 || header.version != 1) return false;
+
+    shareSuffix = ESortType(header.sortType) == ESortType::LastLetterAsc;
+    cursor = mapping->Data() + sizeof(header);
+    end = mapping->Data() + mapping->Size();
+    DecodeNextBlockLater();
+    Refill();
+    return true;
+}
+
+// Queues the block at the cursor for decoding on the pool and moves the cursor past it.
+void SpillRunReader::DecodeNextBlockLater() {
+    hasNext = false;
+    if (size_t(end - cursor) < sizeof(SpillBlockHeader)) return;
+    SpillBlockHeader block{};
+    memcpy(&block, cursor, sizeof(block));
+    const char* payload = cursor + sizeof(block);
+    if (block.storedBytes > size_t(end - payload)) {
+        throw runtime_error("truncated spill run " + path);
+    }
+    cursor = payload + block.storedBytes;
+
+    auto decoded = make_shared<vector<string>>();
+    nextLines = decoded;
+    bool suffix = shareSuffix;
+    string runPath = path;
+    // The mapping is captured too, so a reader dropped mid-merge cannot unmap it under the decoder.
+    nextDecode = decoders->Submit([block, payload, suffix, decoded, runPath, keepAlive = mapping]() {
+        if (!DecodeSpillBlock(block, payload, suffix, *decoded)) {
+            throw runtime_error("damaged block in spill run " + runPath);
+        }
+    });
+    hasNext = true;
+}
+
+void SpillRunReader::Advance() {
+    ++position;
+    Refill();
+}
+
+// Once the current block is used up, takes the decoded next one and queues the one after.
+void SpillRunReader::Refill() {
+    while (position >= lines.size() && hasNext) {
+        nextDecode.get();
+        lines = std::move(*nextLines);
+        position = 0;
+        DecodeNextBlockLater();
+    }
+}
+
+RunSpiller::RunSpiller(string directory, string namePrefix, ESortType type, size_t runBytes, EIoMode ioMode,
+                       bool spillOnPressure)
+    : spillDirectory(std::move(directory)), prefix(std::move(namePrefix)), sortType(type), runLimit(runBytes),
+      writeMode(ioMode), onPressure(spillOnPressure), pool(max(2u, thread::hardware_concurrency())) {
+    error_code ec;
+    fs::create_directories(spillDirectory, ec);
+}
+
+// A checkpointed spiller that did not complete leaves its runs and log for the next attempt.
+RunSpiller::~RunSpiller() {
+    for (auto& write : writes) {
+        if (write.valid()) write.wait();
+    }
+    for (const auto & run : pending) memoryGovernor.Release(EMemoryUse::Lines, run.bytes);
+    if (checkpointing && !completed) return;
+    error_code ec;
+    for (const auto & runPath : runPaths) fs::remove(runPath, ec);
+    if (checkpointing) fs::remove(logPath, ec);
+}
+
+////// Checkpoint Log
+// <prefix>.checkpoint in the spill directory, tab separated:
+//   v1 checkpoint <sortType>
+//   run <number> <lineCount> <fileHash> <inputCount>      followed by inputCount lines of
+//   input <size> <modified> <path>
+// A record is appended in one write, after its run file is synced. A torn last record is ignored.
+// Only reading and run-sorting are logged. The final merge writes the output from the start on every attempt.
+
+// Starts checkpointing and returns the inputs still to be read. Runs from an earlier attempt are kept when
+// their file hash checks out and every input they hold is still in the job, unchanged since it was read.
+vector<string> RunSpiller::Resume(const vector<string>& inputFiles) {
+    checkpointing = true;
+    logPath = (fs::path(spillDirectory) / (prefix + ".checkpoint")).string();
+
+    map<string, size_t> unclaimed;
+    map<string, const InputIdentity*> byPath;
+    for (const auto & file : inputFiles) {
+        error_code ec;
+        InputIdentity identity;
+        identity.path = fs::weakly_canonical(file, ec).string();
+        identity.size = fs::file_size(file, ec);
+        identity.modified = int64_t(fs::last_write_time(file, ec).time_since_epoch().count());
+        if (ec) continue;
+        ++unclaimed[identity.path];
+        identities[file] = identity;
+    }
+    for (const auto & [file, identity] : identities) byPath[identity.path] = &identity;
+
+    vector<string> keptRecords;
+    size_t keptLines = 0;
+    ifstream logIn(logPath);
+    string line;
+    if (getline(logIn, line) && line == "v1\tcheckpoint\t" + to_string(int(sortType))) {
+        while (getline(logIn, line)) {
+            size_t runNumber = 0, lineCount = 0, inputCount = 0;
+            unsigned long long fileHash = 0;
+            if (sscanf(line.c_str(), "run\t%zu\t%zu\t%llx\t%zu", &runNumber, &lineCount, &fileHash, &inputCount) != 4) break;
+            string record = line + '\n';
+            map<string, size_t> claimed;
+            bool isUsable = true;
+            size_t read = 0;
+            for (; read < inputCount && getline(logIn, line); ++read) {
+                record += line + '\n';
+                istringstream fields(line);
+                string tag, path;
+                InputIdentity logged;
+                fields >> tag >> logged.size >> logged.modified;
+                fields.ignore(1);
+                getline(fields, path);
+                auto it = byPath.find(path);
+                isUsable = isUsable && tag == "input" && it != byPath.end() && it->second->size == logged.size &&
+                           it->second->modified == logged.modified && ++claimed[path] <= unclaimed[path];
+            }
+            if (read < inputCount) break;
+
+            char name[32];
+            snprintf(name, sizeof(name), ".%06zu.run", runNumber);
+            string runPath = (fs::path(spillDirectory) / (prefix + name)).string();
+            if (isUsable) {
+                MappedFile run(runPath);
+                isUsable = run.IsOpen() && HashBytes(run.Data(), run.Size()) == fileHash;
+            }
+            if (!isUsable) {
+                error_code ec;
+                fs::remove(runPath, ec);
+                continue;
+            }
+            for (const auto & [path, count] : claimed) unclaimed[path] -= count;
+            runPaths.push_back(runPath);
+            keptRecords.push_back(record);
+            keptLines += lineCount;
+            nextRunNumber = max(nextRunNumber, runNumber + 1);
+        }
+    }
+    logIn.close();
+
+    // The log is rewritten with the kept records only, then appended to as new runs finish.
+    string tempPath = logPath + ".tmp";
+    {
+        ofstream logOut(tempPath, ios::binary | ios::trunc);
+        logOut << "v1\tcheckpoint\t" << int(sortType) << '\n';
+        for (const auto & record : keptRecords) logOut << record;
+    }
+    SyncFile(tempPath);
+    error_code ec;
+    fs::rename(tempPath, logPath, ec);
+
+    vector<string> remaining;
+    for (const auto & file : inputFiles) {
+        auto it = identities.find(file);
+        if (it != identities.end() && unclaimed[it->second.path] == 0) continue;
+        if (it != identities.end()) --unclaimed[it->second.path];
+        remaining.push_back(file);
+    }
+    if (!runPaths.empty()) {
+        cout << "Resuming " << prefix << ": " << runPaths.size() << " runs, " << keptLines << " lines, "
+             << inputFiles.size() - remaining.size() << " of " << inputFiles.size() << " inputs already sorted" << endl;
+    }
+    return remaining;
+}
+
+// Called on the pool once a run file is written. Sources are inputs whose lines are all in that run. A run
+// holding an input Resume could not stat is left out of the log, so the next attempt reads it again.
+void RunSpiller::LogRun(size_t runNumber, size_t lineCount, uint64_t fileHash, const vector<string>& sources) {
+    char hash[24];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fileHash);
+    string record = "run\t" + to_string(runNumber) + '\t' + to_string(lineCount) + '\t' + hash + '\t' + to_string(sources.size()) + '\n';
+    for (const auto & source : sources) {
+        auto it = identities.find(source);
+        if (it == identities.end()) return;
+        const InputIdentity& identity = it->second;
+        record += "input\t" + to_string(identity.size) + '\t' + to_string(identity.modified) + '\t' + identity.path + '\n';
+    }
+
+    lock_guard<mutex> lock(logMutex);
+    ofstream logOut(logPath, ios::binary | ios::app);
+    logOut << record;
+    logOut.close();
+    if (!logOut || !SyncFile(logPath)) {
+        throw runtime_error("unable to write checkpoint log " + logPath);
+    }
+}
+
+// Sources name the inputs this run completes. With checkpointing a run may only hold whole inputs, so
+// every batch of an input must arrive in one Add.
+void RunSpiller::Add(vector<string>&& sortedRun, vector<string> sources) {
+    PendingRun run{ std::move(sortedRun), std::move(sources), 0 };
+    run.bytes = LineBytes(run.lines);
+    memoryGovernor.Charge(EMemoryUse::Lines, run.bytes);
+
+    lock_guard<mutex> lock(spillMutex);
+    pendingBytes += run.bytes;
+    pending.push_back(std::move(run));
+    if (KeepsRunsInMemory()) {
+        if (!memoryGovernor.ShouldSpill()) return;
+        cout << "Memory use at " << memoryGovernor.Used() / (1024 * 1024) << " of " << memoryGovernor.Limit() / (1024 * 1024)
+             << " MB (lines " << memoryGovernor.UsedBy(EMemoryUse::Lines) / (1024 * 1024)
+             << ", sort scratch " << memoryGovernor.UsedBy(EMemoryUse::SortScratch) / (1024 * 1024)
+             << ", buffers " << memoryGovernor.UsedBy(EMemoryUse::IoBuffers) / (1024 * 1024)
+             << ", queues " << memoryGovernor.UsedBy(EMemoryUse::Queues) / (1024 * 1024)
+             << "), spilling runs to " << spillDirectory << endl;
+        SpillPending();
+        return;
+    }
+    if (pendingBytes >= runLimit) SpillPending();
+
+    // Past the limit the producers wait for the oldest write, so runs cannot pile up faster than the disk
+    // takes them.
+    while (onPressure && memoryGovernor.Used() > memoryGovernor.Limit() && waitedWrites < writes.size()) {
+        writes[waitedWrites++].wait();
+    }
+}
+
+// For a spiller that never spilled: the runs go back to the caller for an in-memory merge.
+vector<vector<string>> RunSpiller::TakeRuns() {
+    lock_guard<mutex> lock(spillMutex);
+    vector<vector<string>> runs;
+    for (auto& run : pending) {
+        memoryGovernor.Release(EMemoryUse::Lines, run.bytes);
+        runs.push_back(std::move(run.lines));
+    }
+    pending.clear();
+    pendingBytes = 0;
+    // Nothing was written, so there is nothing to resume from.
+    completed = true;
+    return runs;
+}
+
+// Only called with spillMutex held. Pending runs go out in groups of about runLimit bytes, each merged and
+// compressed on the pool.
+void RunSpiller::SpillPending() {
+    for (size_t first = 0; first < pending.size(); ) {
+        auto runs = make_shared<vector<vector<string>>>();
+        auto sources = make_shared<vector<string>>();
+        size_t groupBytes = 0;
+        for (; first < pending.size() && groupBytes < runLimit; ++first) {
+            groupBytes += pending[first].bytes;
+            runs->push_back(std::move(pending[first].lines));
+            move(pending[first].sources.begin(), pending[first].sources.end(), back_inserter(*sources));
+        }
+
+        size_t runNumber = nextRunNumber++;
+        char name[32];
+        snprintf(name, sizeof(name), ".%06zu.run", runNumber);
+        string runPath = (fs::path(spillDirectory) / (prefix + name)).string();
+        runPaths.push_back(runPath);
+        ESortType type = sortType;
+        EIoMode ioMode = writeMode;
+        bool logged = checkpointing;
+        writes.push_back(pool.Submit([this, runs, sources, runPath, runNumber, type, ioMode, logged, groupBytes]() {
+            vector<string> merged;
+            {
+                MemoryCharge scratch(EMemoryUse::SortScratch, groupBytes);
+                merged = MergeRuns(std::move(*runs), type);
+            }
+            uint64_t fileHash = 0;
+            bool written = WriteSpillRun(merged, runPath, type, ioMode, &fileHash) && (!logged || SyncFile(runPath));
+            size_t lineCount = merged.size();
+            merged = vector<string>();
+            memoryGovernor.Release(EMemoryUse::Lines, groupBytes);
+            if (!written) {
+                throw runtime_error("unable to write spill run " + runPath);
+            }
+            if (logged) LogRun(runNumber, lineCount, fileHash, *sources);
+        }));
+    }
+    pending.clear();
+    pendingBytes = 0;
+}
+
+void RunSpiller::Finish() {
+    {
+        lock_guard<mutex> lock(spillMutex);
+        SpillPending();
+    }
+    for (auto& write : writes) write.get();
+    writes.clear();
+}
+
+// k-way merge over all runs, smallest head first, with each run's blocks decoded ahead on the pool.
+void RunSpiller::Merge(const function<void(const string&)>& emit) {
+    vector<unique_ptr<SpillRunReader>> readers;
+    for (const auto & runPath : runPaths) {
+        auto reader = make_unique<SpillRunReader>();
+        if (!reader->Open(runPath, pool)) {
+            throw runtime_error("unable to open spill run " + runPath);
+        }
+        if (reader->HasHead()) readers.push_back(std::move(reader));
+    }
+
+    unique_ptr<IStringComparer> stringComparer = MakeComparer(sortType);
+    auto headIsAfter = [&](const unique_ptr<SpillRunReader>& a, const unique_ptr<SpillRunReader>& b) {
+        return SortsBefore(stringComparer.get(), b->Head(), a->Head());
+    };
+    make_heap(readers.begin(), readers.end(), headIsAfter);
+    while (!readers.empty()) {
+        pop_heap(readers.begin(), readers.end(), headIsAfter);
+        emit(readers.back()->Head());
+        readers.back()->Advance();
+        if (readers.back()->HasHead()) push_heap(readers.begin(), readers.end(), headIsAfter);
+        else readers.pop_back();
+    }
+}
+
+// Null unless the options ask for an external sort. Runs are named after the output so concurrent jobs
+// sharing a spill directory do not collide.
+// spill=<dir> when given, otherwise a directory under the system temp directory.
+string SpillDirectoryFor(const SortOptions& options) {
+    if (!options.spillDirectory.empty()) return options.spillDirectory;
+    error_code ec;
+    return (fs::temp_directory_path(ec) / "TextFileSorter").string();
+}
+
+// Checkpointing is started separately with Resume, by callers that feed whole inputs to Add. A memory
+// limit also sets the governor's, and makes a spiller that only spills under pressure, in runs of at most
+// an eighth of the limit so writing one never needs much scratch.
+unique_ptr<RunSpiller> MakeSpiller(const string& outputPath, ESortType sortType, const SortOptions& options) {
+    string prefix = fs::path(outputPath).filename().string();
+    if (options.memoryLimitBytes > 0) {
+        memoryGovernor.SetLimit(options.memoryLimitBytes);
+        size_t runBytes = min(options.spillRunBytes, max<size_t>(options.memoryLimitBytes / 8, 1024 * 1024));
+        return make_unique<RunSpiller>(SpillDirectoryFor(options), prefix, sortType, runBytes, options.ioMode, true);
+    }
+    if (options.spillDirectory.empty()) return nullptr;
+    return make_unique<RunSpiller>(options.spillDirectory, prefix, sortType, options.spillRunBytes, options.ioMode);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Coroutine Pipeline
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Stages are coroutines that run on a WorkerPool. A stage waiting on a channel is a suspended frame, not a
+// blocked thread. Reads are planned as for --scan: small files go in groups through ReadManyFiles, where one
+// pool thread keeps up to the ring's depth of reads in flight, and large files are cut into byte ranges.
+
+template <typename T> class Task;
+
+template <typename T>
+struct TaskPromiseBase {
+    coroutine_handle<> continuation;
+    exception_ptr error;
+
+    suspend_always initial_suspend() noexcept { return {}; }
+
+    // Finishing resumes whoever awaited the task, on the same thread, without growing the stack.
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename TPromise>
+        coroutine_handle<> await_suspend(coroutine_handle<TPromise> finished) noexcept {
+            coroutine_handle<> next = finished.promise().continuation;
+            return next ? next : noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase<T> {
+    optional<T> value;
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T TakeResult() {
+        if (this->error) rethrow_exception(this->error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+    Task<void> get_return_object();
+    void return_void() {}
+    void TakeResult() {
+        if (error) rethrow_exception(error);
+    }
+};
+
+// Lazily started coroutine producing a T. Starts when awaited, resumes the awaiter when done.
+template <typename T>
+class [[nodiscard]] Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(coroutine_handle<promise_type> coroutine) : handle(coroutine) {}
+    Task(Task&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().TakeResult(); }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Fire-and-forget coroutine that starts immediately and frees itself when it ends.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Starts a task without waiting for it. done is fulfilled with the task's result or exception.
+static DetachedTask StartTask(Task<void> task, promise<void>* done) {
+    try {
+        co_await task;
+        done->set_value();
+    } catch (...) {
+        done->set_exception(current_exception());
+    }
+}
+
+// Blocks the calling thread, which must not be a pool thread, until the task finishes.
+static void SyncWait(Task<void> task) {
+    promise<void> done;
+    future<void> finished = done.get_future();
+    StartTask(std::move(task), &done);
+    finished.get();
+}
+
+// co_await ScheduleOn(pool) continues the coroutine on one of the pool's threads.
+struct ScheduleOn {
+    WorkerPool& pool;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> coroutine) const {
+        pool.Submit([coroutine]() { coroutine.resume(); });
+    }
+    void await_resume() const noexcept {}
+};
+
+// Bounded channel between coroutines. Send suspends while the channel is full and Receive suspends while it
+// is empty. Suspended coroutines are resumed on the pool. Receive yields nullopt once closed and drained.
+template <typename T>
+class AsyncChannel {
+public:
+    AsyncChannel(WorkerPool& workerPool, size_t capacity) : pool(workerPool), limit(capacity) {}
+
+    struct SendAwaiter {
+        AsyncChannel& channel;
+        T value;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> coroutine) {
+            lock_guard<mutex> lock(channel.channelMutex);
+            if (!channel.receivers.empty()) {
+                auto [receiver, slot] = channel.receivers.front();
+                channel.receivers.pop_front();
+                *slot = std::move(value);
+                channel.Resume(receiver);
+                return false;
+            }
+            if (channel.items.size() < channel.limit) {
+                channel.items.push_back(std::move(value));
+                return false;
+            }
+            channel.senders.emplace_back(coroutine, &value);
+            return true;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct ReceiveAwaiter {
+        AsyncChannel& channel;
+        optional<T> result;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> coroutine) {
+            lock_guard<mutex> lock(channel.channelMutex);
+            if (!channel.items.empty()) {
+                result = std::move(channel.items.front());
+                channel.items.pop_front();
+                // Room was made, let one waiting sender in.
+                if (!channel.senders.empty()) {
+                    auto [sender, value] = channel.senders.front();
+                    channel.senders.pop_front();
+                    channel.items.push_back(std::move(*value));
+                    channel.Resume(sender);
+                }
+                return false;
+            }
+            if (channel.closed) return false;
+            channel.receivers.emplace_back(coroutine, &result);
+            return true;
+        }
+        optional<T> await_resume() { return std::move(result); }
+    };
+
+    SendAwaiter Send(T value) { return SendAwaiter{ *this, std::move(value) }; }
+    ReceiveAwaiter Receive() { return ReceiveAwaiter{ *this, nullopt }; }
+
+    void Close() {
+        lock_guard<mutex> lock(channelMutex);
+        closed = true;
+        for (auto& [receiver, slot] : receivers) Resume(receiver);
+        receivers.clear();
+    }
+
+private:
+    void Resume(coroutine_handle<> coroutine) {
+        pool.Submit([coroutine]() { coroutine.resume(); });
+    }
+
+    WorkerPool& pool;
+    size_t limit;
+    mutex channelMutex;
+    deque<T> items;
+    deque<pair<coroutine_handle<>, T*>> senders;
+    deque<pair<coroutine_handle<>, optional<T>*>> receivers;
+    bool closed = false;
+};
+
+// Awaitable merge of the sorted runs and write of the finished output.
+static Task<void> MergeAndWriteAsync(WorkerPool& pool, vector<vector<string>> runs, string outputPath,
+                                     clock_t startTime, ESortType sortType, SortOptions options) {
+    co_await ScheduleOn{ pool };
+    MergeWriteAndPrint(std::move(runs), outputPath, startTime, sortType, options);
+}
+
+// Valid lines of one input file, all of them unless the file was read in ranges or decoded in pieces.
+struct FileBatch {
+    string fileName;
+    vector<string> lines;
+    bool isWholeFile = true;
+};
+
+// Pools the pipeline's reads block on. They are not the pipeline's own, so a read never waits on the
+// threads it runs on.
+struct PipelineReadPools {
+    WorkerPool parsers{ max(1u, thread::hardware_concurrency()) };
+    WorkerPool fallbackReaders{ max(4u, thread::hardware_concurrency() * 2) };
+};
+
+// Awaitable read of one unit: the coroutine hops onto the pool and reads the unit there. Returns one batch
+// per small file, or the lines of one range or decoded piece of a large file per batch.
+static Task<vector<FileBatch>> LoadUnitAsync(WorkerPool& pool, PipelineReadPools& readPools, ReadUnit unit) {
+    co_await ScheduleOn{ pool };
+    vector<FileBatch> loaded;
+    if (unit.isCompressed) {
+        ReadCompressedFile(unit.files[0], [&](vector<string>&& lines) {
+            loaded.push_back(FileBatch{ unit.files[0], std::move(lines), false });
+        });
+    } else if (unit.isRange) {
+        FileBatch batch{ unit.files[0], {}, false };
+        ReadFileRange(unit.files[0], unit.offset, unit.length, batch.lines);
+        loaded.push_back(std::move(batch));
+    } else {
+        loaded.resize(unit.files.size());
+        ReadManyFiles(unit.files, readPools.parsers, readPools.fallbackReaders, [&](size_t index, vector<string>&& lines) {
+            loaded[index] = FileBatch{ unit.files[index], std::move(lines), true };
+        });
+    }
+    co_return loaded;
+}
+
+// The units --scan reads, except that a checkpointed run may only hold whole inputs: then large files are
+// read whole, and one larger than memory= could not be held, so it is refused.
+static vector<ReadUnit> PlanPipelineReads(const vector<string>& inputFiles, const SortOptions& options) {
+    vector<InputFile> files;
+    vector<ReadUnit> units;
+    for (const auto & file : inputFiles) {
+        error_code ec;
+        InputFile input{ file, fs::file_size(file, ec) };
+        if (ec) input.size = 0;
+        if (!options.checkpoint || input.size < CHUNKED_READ_THRESHOLD) {
+            files.push_back(input);
+            continue;
+        }
+        if (options.memoryLimitBytes > 0 && input.size > options.memoryLimitBytes) {
+            throw runtime_error("checkpoint=on reads inputs whole and " + file + " is larger than memory=");
+        }
+        ReadUnit unit;
+        unit.files.push_back(file);
+        unit.bytes = input.size;
+        units.push_back(std::move(unit));
+    }
+    for (auto& unit : PlanReads(files)) units.push_back(std::move(unit));
+    return units;
+}
+
+// Leaving reader: the last one out closes the channel, also when a read throws, so the sort stages finish.
+struct ReaderExit {
+    AsyncChannel<FileBatch>& batches;
+    atomic<size_t>& remaining;
+    ~ReaderExit() {
+        if (remaining.fetch_sub(1) == 1) batches.Close();
+    }
+};
+
+// read -> validate: each reader takes the next unread unit until none are left.
+static Task<void> ReadStage(WorkerPool& pool, PipelineReadPools& readPools, const vector<ReadUnit>& units,
+                            atomic<size_t>& nextUnit, AsyncChannel<FileBatch>& batches, atomic<size_t>& remaining) {
+    ReaderExit leaving{ batches, remaining };
+    for (size_t i = nextUnit++; i < units.size(); i = nextUnit++) {
+        vector<FileBatch> loaded = co_await LoadUnitAsync(pool, readPools, units[i]);
+        for (auto& batch : loaded) {
+            if (batch.lines.empty()) continue;
+            memoryGovernor.Charge(EMemoryUse::Queues, LineBytes(batch.lines));
+            co_await batches.Send(std::move(batch));
+        }
+    }
+}
+
+// run-sort: turns every batch it receives into a sorted run, kept here or handed to the spiller.
+static Task<void> SortStage(WorkerPool& pool, AsyncChannel<FileBatch>& batches, ESortType sortType,
+                            vector<vector<string>>& runs, RunSpiller* spiller) {
+    while (optional<FileBatch> batch = co_await batches.Receive()) {
+        co_await ScheduleOn{ pool };
+        size_t bytes = LineBytes(batch->lines);
+        memoryGovernor.Release(EMemoryUse::Queues, bytes);
+        vector<string> run;
+        {
+            MemoryCharge scratch(EMemoryUse::SortScratch, bytes);
+            run = MergeSortWrapper(std::move(batch->lines), sortType);
+        }
+        if (spiller && batch->isWholeFile) spiller->Add(std::move(run), { batch->fileName });
+        else if (spiller) spiller->Add(std::move(run));
+        else runs.push_back(std::move(run));
+    }
+}
+
+static Task<void> SortPipeline(WorkerPool& pool, SortJob job, vector<string> inputFiles) {
+    clock_t startTime = clock();
+    string outputPath = OutputPathFor(job.outputName, job.options);
+    unique_ptr<RunSpiller> spiller = MakeSpiller(outputPath, job.sortType, job.options);
+    if (spiller && job.options.checkpoint) inputFiles = spiller->Resume(inputFiles);
+    vector<ReadUnit> units = PlanPipelineReads(inputFiles, job.options);
+    PipelineReadPools readPools;
+    AsyncChannel<FileBatch> batches(pool, 2 * pool.Size());
+    // Half the threads read, each driving many reads at once, so the other half is left to sort.
+    size_t readerCount = min(size_t(max(1u, pool.Size() / 2)), units.size());
+    atomic<size_t> remaining(readerCount);
+    atomic<size_t> nextUnit(0);
+
+    vector<promise<void>> readersDone(readerCount);
+    for (size_t i = 0; i < readerCount; ++i) {
+        StartTask(ReadStage(pool, readPools, units, nextUnit, batches, remaining), &readersDone[i]);
+    }
+    if (readerCount == 0) batches.Close();
+
+    // One sorter per thread, each with its own runs so they never share a vector.
+    vector<vector<vector<string>>> runsPerSorter(pool.Size());
+    vector<promise<void>> sortersDone(pool.Size());
+    vector<future<void>> sorters;
+    for (size_t i = 0; i < runsPerSorter.size(); ++i) {
+        sorters.push_back(sortersDone[i].get_future());
+        StartTask(SortStage(pool, batches, job.sortType, runsPerSorter[i], spiller.get()), &sortersDone[i]);
+    }
+    // The pipeline body is still on the thread that called SyncWait here, so it can block on the stages.
+    // Every stage is waited for before any error is rethrown, as they all point into this frame.
+    vector<future<void>> readers;
+    for (auto& done : readersDone) readers.push_back(done.get_future());
+    for (auto& sorter : sorters) sorter.wait();
+    for (auto& reader : readers) reader.wait();
+    for (auto& sorter : sorters) sorter.get();
+    for (auto& reader : readers) reader.get();
+
+    // merge -> write, as one step when the runs can be merged straight into a mapped output
+    vector<vector<string>> runs;
+    if (spiller && spiller->KeepsRunsInMemory()) {
+        runs = spiller->TakeRuns();
+        spiller.reset();
+    }
+    if (spiller) {
+        co_await ScheduleOn{ pool };
+        MergeSpilledWriteAndPrint(*spiller, outputPath, startTime, job.sortType, job.options);
+        spiller->Complete();
+        co_return;
+    }
+    for (auto& sorterRuns : runsPerSorter) {
+        for (auto& run : sorterRuns) runs.push_back(std::move(run));
+    }
+    co_await MergeAndWriteAsync(pool, std::move(runs), outputPath, startTime, job.sortType, job.options);
+}
+
+int RunCoroutinePipeline(const SortJob& job) {
+    WorkerPool pool(max(2u, thread::hardware_concurrency()));
+    try {
+        SyncWait(SortPipeline(pool, job, ExpandJobInputs(job)));
+    } catch (const exception& e) {
+        cerr << "ERROR: pipeline failed: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
 }